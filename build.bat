@@ -23,6 +23,10 @@ for %%a in (%*) do (
 		set PDB_OPT=/PDB:"%BUILD_DIR%\%EXE_NAME%.pdb"
     	echo Using DEBUG build
     )
+    if "%%a"=="Stats" (
+		set STATS_FLAGS=/D "ENABLE_STATS"
+    	echo Collecting --stats counters
+    )
 )
 
 REM Create the build directory if it doesn't exist
@@ -37,7 +41,7 @@ if not exist "%VCVARS_PATH%" (
 REM Set up the Visual Studio envionment (for cl command)
 call "%VCVARS_PATH%" x64
 
-cl %BUILD_FLAGS% ^
+cl %BUILD_FLAGS% %STATS_FLAGS% ^
 	/I"include" ^
 	/Fo"%BUILD_DIR%\\" ^
 	/Fe"%OUTPUT_EXE%" ^
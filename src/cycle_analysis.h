@@ -0,0 +1,308 @@
+#pragma once
+
+// Static per-loop cycle estimates.
+//
+// A loop is a backward jump (the jcc and loop family, i.e. OP_CLASS_JUMP)
+// to an earlier instruction. Its body is every instruction from the target
+// up to and including the jump, and one iteration costs the sum of their
+// 8086 clocks with the back edge taken and every other branch falling
+// through. Memory operands pay their EA clocks (effective_address_clocks).
+//
+// Clocks come from the 8086 timing tables. Where the real count depends on
+// runtime values (mul/div operands, shift counts in cl, rep counts) the
+// estimate uses the worst case for the operand size, one shift step and a
+// single rep element. Word operands are assumed to be at even addresses, so
+// the 4 clocks an odd address adds per transfer are not counted.
+
+#include "decoder.h"
+#include "instruction_store.h"
+
+// Clocks for a string instruction's element, by the real operation.
+inline int string_element_clocks(u8 opcode, bool rep) {
+    switch (opcode & 0xFE) {
+        case 0xA4: return rep ? 17 : 18; // movs
+        case 0xA6: return 22;            // cmps
+        case 0xAA: return rep ? 10 : 11; // stos
+        case 0xAC: return rep ? 13 : 12; // lods
+        case 0xAE: return 15;            // scas
+    }
+    return 0;
+}
+
+int instruction_clocks(DecodedInstruction* instruction, bool branch_taken) {
+    u8 op = instruction->opcode;
+    bool memory = instruction->ea.form != 0;
+    int ea = memory ? effective_address_clocks(&instruction->ea) : 0;
+    u8 reg = instruction->reg;
+
+    switch (instruction->op_class) {
+        case OP_CLASS_REGISTER_MEMORY_AND_REGISTER: {
+            if (op >= 0x88 && op <= 0x8B) {                 // mov
+                return memory ? (instruction->dir ? 8 : 9) + ea : 2;
+            } else if (op == 0x8D) {                        // lea
+                return 2 + ea;
+            } else if (op == 0xC4 || op == 0xC5) {          // les, lds
+                return 16 + ea;
+            } else if (op == 0x84 || op == 0x85) {          // test
+                return memory ? 9 + ea : 3;
+            } else if (op == 0x86 || op == 0x87) {          // xchg
+                return memory ? 17 + ea : 4;
+            }
+
+            bool is_cmp = ((op >> 3) & 0x07) == 7;
+            if (!memory) {
+                return 3;
+            }
+            return (instruction->dir || is_cmp) ? 9 + ea : 16 + ea;
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY: {
+            if (op == 0xC6 || op == 0xC7) {                 // mov
+                return memory ? 10 + ea : 4;
+            } else if (op == 0xF6 || op == 0xF7) {          // test
+                return memory ? 11 + ea : 5;
+            }
+
+            bool is_cmp = reg == 7;
+            if (!memory) {
+                return 4;
+            }
+            return is_cmp ? 10 + ea : 17 + ea;
+        } break;
+
+        case OP_CLASS_REGISTER_MEMORY: {
+            if (op == 0x8F) {                               // pop
+                return memory ? 17 + ea : 8;
+            }
+
+            if (instruction->is_bit_shift) {
+                if (instruction->shift_by_cl) {
+                    return memory ? 20 + ea + 4 : 8 + 4;
+                }
+                return memory ? 15 + ea : 2;
+            }
+
+            if (op == 0xF6 || op == 0xF7) {
+                bool w = instruction->word;
+                int clocks = 0;
+                switch (reg) {
+                    case 2:
+                    case 3: return memory ? 16 + ea : 3;    // not, neg
+                    case 4: clocks = w ? 133 : 77;  break;  // mul
+                    case 5: clocks = w ? 154 : 98;  break;  // imul
+                    case 6: clocks = w ? 162 : 90;  break;  // div
+                    case 7: clocks = w ? 184 : 112; break;  // idiv
+                }
+                return memory ? clocks + 6 + ea : clocks;
+            }
+
+            switch (reg) {                                  // FE/FF
+                case 0:
+                case 1: return memory ? 15 + ea : (op == 0xFF ? 2 : 3); // inc, dec
+                case 2: return memory ? 21 + ea : 16;       // call
+                case 3: return 37 + ea;                     // call far
+                case 4: return memory ? 18 + ea : 11;       // jmp
+                case 5: return 24 + ea;                     // jmp far
+                case 6: return memory ? 16 + ea : 11;       // push
+            }
+        } break;
+
+        case OP_CLASS_SEG_REG: {
+            if (op == 0x8C) {
+                return memory ? 9 + ea : 2;
+            }
+            return memory ? 8 + ea : 2;
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_ACCUMULATOR: {
+            return (op >= 0xE4 && op <= 0xE7) ? 10 : 4;
+        } break;
+
+        case OP_CLASS_IMMEDIATE: {
+            if (op == 0xC2) return 12;
+            if (op == 0xCA) return 17;
+            return 51;                                      // int
+        } break;
+
+        case OP_CLASS_REGISTER: {
+            if (op < 0x50) return 2;                        // inc, dec
+            return (op < 0x58) ? 11 : 8;                    // push, pop
+        } break;
+
+        case OP_CLASS_SEGMENT:               return (op & 0x01) ? 8 : 10;
+        case OP_CLASS_ACCUMULATOR_REGISTER:  return 3;
+        case OP_CLASS_IMMEDIATE_TO_REGISTER: return 4;
+        case OP_CLASS_ACCUMULATOR_DX:        return 8;
+
+        case OP_CLASS_ACCUMULATOR_MEMORY: {
+            return 10 + (instruction->has_segment_override ? SEGMENT_OVERRIDE_CLOCKS : 0);
+        } break;
+
+        case OP_CLASS_STRING: {
+            if (instruction->rep) {
+                return 9 + string_element_clocks(op, true);
+            }
+            return string_element_clocks(op, false);
+        } break;
+
+        case OP_CLASS_JUMP: {
+            switch (op) {
+                case 0xE0: return branch_taken ? 19 : 5;    // loopnz
+                case 0xE1: return branch_taken ? 18 : 6;    // loopz
+                case 0xE2: return branch_taken ? 17 : 5;    // loop
+                case 0xE3: return branch_taken ? 18 : 6;    // jcxz
+            }
+            return branch_taken ? 16 : 4;
+        } break;
+
+        case OP_CLASS_NEAR_RELATIVE:  return (op == 0xE8) ? 19 : 15;
+        case OP_CLASS_SHORT_RELATIVE: return 15;
+        case OP_CLASS_FAR_POINTER:    return (op == 0x9A) ? 28 : 15;
+
+        case OP_CLASS_NONE: {
+            switch (op) {
+                case 0x27: case 0x2F: return 4;             // daa, das
+                case 0x37: case 0x3F: return 8;             // aaa, aas
+                case 0x98: return 2;                        // cbw
+                case 0x99: return 5;                        // cwd
+                case 0x9B: return 3;                        // wait
+                case 0x9C: return 10;                       // pushf
+                case 0x9D: return 8;                        // popf
+                case 0x9E: case 0x9F: return 4;             // sahf, lahf
+                case 0xC3: return 8;                        // ret
+                case 0xCB: return 18;                       // retf
+                case 0xCC: return 52;                       // int3
+                case 0xCE: return 53;                       // into
+                case 0xCF: return 24;                       // iret
+                case 0xD4: return 83;                       // aam
+                case 0xD5: return 60;                       // aad
+                case 0xD7: return 11;                       // xlat
+            }
+            return 2;                                       // hlt, cmc, flag ops
+        } break;
+    }
+
+    return 0;
+}
+
+inline bool has_memory_operand(DecodedInstruction* instruction) {
+    return instruction->ea.form != 0 || instruction->op_class == OP_CLASS_ACCUMULATOR_MEMORY;
+}
+
+struct LoopEstimate {
+    int start;               // loop target
+    int end;                 // address of the backward jump
+    int instruction_count;
+    int memory_operands;
+    int cycles;              // per iteration
+};
+
+struct LoopAnalysis {
+    int count;
+    LoopEstimate* loops;     // most expensive first
+};
+
+int compare_loop_cycles(const void* a, const void* b) {
+    const LoopEstimate* x = (const LoopEstimate*)a;
+    const LoopEstimate* y = (const LoopEstimate*)b;
+    if (x->cycles != y->cycles) {
+        return (x->cycles < y->cycles) ? 1 : -1;
+    }
+    return x->start - y->start;
+}
+
+// Index of the instruction starting at address, or -1.
+int find_instruction(InstructionStore* store, int address) {
+    int low = 0;
+    int high = store->count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int found = (int)store->addresses[middle];
+        if (found == address) {
+            return middle;
+        } else if (found < address) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+// Finds every loop in a decoded image and estimates its cost. bytes is the
+// image the store was decoded from.
+void analyze_loops(LoopAnalysis* analysis, InstructionStore* store, u8* bytes, int size, MemoryArena* arena) {
+    // Running totals of fall-through clocks and memory operands, so the cost
+    // of any body is a difference of two entries.
+    int* clocks = (int*)arena_alloc(arena, (store->count + 1) * sizeof(int));
+    int* memory = (int*)arena_alloc(arena, (store->count + 1) * sizeof(int));
+    clocks[0] = 0;
+    memory[0] = 0;
+
+    DecodeContext ctx;
+    init_decode_context(&ctx);
+
+    for (int i = 0; i < store->count; i++) {
+        int address = store->addresses[i];
+        DecodedInstruction instruction;
+        decode_one(&ctx, &bytes[address], size - address, address, &instruction);
+
+        clocks[i + 1] = clocks[i] + instruction_clocks(&instruction, false);
+        memory[i + 1] = memory[i] + (has_memory_operand(&instruction) ? 1 : 0);
+    }
+
+    analysis->count = 0;
+    analysis->loops = (LoopEstimate*)arena_alloc(arena, (store->jump_count + 1) * sizeof(LoopEstimate));
+
+    int jump_counter = 0;
+    for (int i = 0; i < store->count; i++) {
+        if (!is_jump(store, i)) {
+            continue;
+        }
+
+        int target = store->jump_targets[jump_counter];
+        jump_counter += 1;
+
+        int address = store->addresses[i];
+        if (target > address) {
+            continue;
+        }
+
+        int first = find_instruction(store, target);
+        if (first < 0) {
+            continue;
+        }
+
+        DecodedInstruction jump;
+        decode_one(&ctx, &bytes[address], size - address, address, &jump);
+
+        LoopEstimate* loop = &analysis->loops[analysis->count];
+        analysis->count += 1;
+
+        loop->start = target;
+        loop->end = address;
+        loop->instruction_count = i - first + 1;
+        loop->memory_operands = memory[i + 1] - memory[first];
+        loop->cycles = clocks[i] - clocks[first] + instruction_clocks(&jump, true);
+    }
+
+    qsort(analysis->loops, analysis->count, sizeof(LoopEstimate), compare_loop_cycles);
+}
+
+void print_loop_report(LoopAnalysis* analysis, int max_loops, FILE* stream = stdout) {
+    fprintf(stream, "loops: %d\n", analysis->count);
+    if (analysis->count == 0) {
+        return;
+    }
+
+    fprintf(stream, "rank  start         end           instructions  memory ops  cycles/iteration\n");
+    for (int i = 0; i < analysis->count && i < max_loops; i++) {
+        LoopEstimate* loop = &analysis->loops[i];
+
+        char start[32];
+        sprintf(start, "label_%d", loop->start);
+
+        fprintf(stream, "%4d  %-12s  %-12d  %12d  %10d  %16d\n",
+                i + 1, start, loop->end, loop->instruction_count, loop->memory_operands, loop->cycles);
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+// Debugging on top of the simulator.
+//
+// step() and the run_until family are thin wrappers over run(). They set a
+// temporary breakpoint or watchpoint, run and clear it again, so the work
+// happens in the DebugHooks loop at close to full speed. Code addresses are
+// named the way the disassembly names them, label_N with N the address in
+// the loaded image.
+
+#include "format.h"
+#include "simulator.h"
+
+// Largest range run_until_write() watches at once.
+#define RUN_UNTIL_WRITE_MAX 256
+
+// Executes count instructions, stopping early at a breakpoint, watchpoint
+// or anything else that ends a run.
+StopReason step(Simulator* sim, u64 count = 1) {
+    return run(sim, count);
+}
+
+// Runs until the instruction at a physical address is about to execute.
+StopReason run_until(Simulator* sim, u32 address, u64 max_instructions = ~0ull) {
+    bool temporary = add_breakpoint(sim, address);
+    StopReason reason = run(sim, max_instructions);
+    if (temporary) {
+        remove_breakpoint(sim, address);
+    }
+    return reason;
+}
+
+// Runs until something writes to any of the size bytes at a physical
+// address. stop_address is the byte written, stop_instruction the writer.
+StopReason run_until_write(Simulator* sim, u32 address, u32 size = 1, u64 max_instructions = ~0ull) {
+    if (size > RUN_UNTIL_WRITE_MAX) {
+        log_error("run_until_write() watches at most %d bytes.", RUN_UNTIL_WRITE_MAX);
+        return STOP_NONE;
+    }
+
+    bool temporary[RUN_UNTIL_WRITE_MAX];
+    for (u32 i = 0; i < size; i++) {
+        temporary[i] = add_watchpoint(sim, address + i);
+    }
+
+    StopReason reason = run(sim, max_instructions);
+
+    for (u32 i = 0; i < size; i++) {
+        if (temporary[i]) {
+            remove_watchpoint(sim, address + i);
+        }
+    }
+    return reason;
+}
+
+inline char* append_label(char* out, u32 address) {
+    out = append_text(out, TEXT("label_"));
+    return append_u32(out, address);
+}
+
+// Writes "label_N: <instruction>" for the code at a physical address.
+int render_location(Simulator* sim, u32 address, char* buffer) {
+    char* out = append_label(buffer, address);
+    out = append_text(out, TEXT(": "));
+
+    DecodeContext ctx;
+    init_decode_context(&ctx);
+
+    DecodedInstruction instruction;
+    u8* memory = sim->machine.memory;
+    if (decode_one(&ctx, &memory[address], MEMORY_SIZE - address, (int)address, &instruction)) {
+        out += render_instruction(&instruction, out);
+    } else {
+        out = append_text(out, TEXT("(invalid)\n"));
+        *out = 0;
+    }
+
+    return (int)(out - buffer);
+}
+
+void print_stop(Simulator* sim, StopReason reason, FILE* stream = stdout) {
+    char location[MAX_INSTRUCTION_TEXT + 32];
+    render_location(sim, sim->stop_instruction, location);
+
+    if (reason == STOP_WATCHPOINT) {
+        fprintf(stream, "watchpoint: write to %u by %s", sim->stop_address, location);
+    } else {
+        fprintf(stream, "%s at %s", stop_reason_names[reason], location);
+    }
+}
@@ -0,0 +1,735 @@
+#pragma once
+
+// 8086 instruction decoder.
+//
+// Decoding is reentrant: the only state is the DecodeContext the caller
+// passes in, the tables below are read only and nothing is allocated.
+// decode_one() decodes a single instruction into a DecodedInstruction and
+// decode() runs it over a buffer, handing every instruction to a sink.
+// Turning instructions into text is format.h's job.
+
+#include "utility.h"
+#include "effective_address.h"
+
+#define MODE_MEMORY_NO_DISPLACEMENT     0
+#define MODE_MEMORY_8_BIT_DISPLACEMENT  1
+#define MODE_MEMORY_16_BIT_DISPLACEMENT 2
+#define MODE_REGISTER                   3
+
+// lock + segment override + opcode + mod/rm + disp16 + data16
+#define DECODE_MAX_INSTRUCTION_LENGTH 8
+
+const Text register_map_byte[8] = {
+    TEXT("al"),
+    TEXT("cl"),
+    TEXT("dl"),
+    TEXT("bl"),
+    TEXT("ah"),
+    TEXT("ch"),
+    TEXT("dh"),
+    TEXT("bh")
+};
+
+const Text register_map_word[8] = {
+    TEXT("ax"),
+    TEXT("cx"),
+    TEXT("dx"),
+    TEXT("bx"),
+    TEXT("sp"),
+    TEXT("bp"),
+    TEXT("si"),
+    TEXT("di")
+};
+
+const Text effective_address_table[8] = {
+    TEXT("bx + si"),
+    TEXT("bx + di"),
+    TEXT("bp + si"),
+    TEXT("bp + di"),
+    TEXT("si"),
+    TEXT("di"),
+    TEXT("bp"),
+    TEXT("bx")
+};
+
+const Text segments[] = { TEXT("es"), TEXT("cs"), TEXT("ss"), TEXT("ds") };
+
+const Text group_one_mnemonics[] = {
+    TEXT("add"),
+    TEXT("or"),
+    TEXT("adc"),
+    TEXT("sbb"),
+    TEXT("and"),
+    TEXT("sub"),
+    TEXT("xor"),
+    TEXT("cmp")
+};
+
+enum OpClass {
+    OP_CLASS_NONE                         = 0,
+    OP_CLASS_REGISTER_MEMORY              = 1,
+    OP_CLASS_REGISTER_MEMORY_AND_REGISTER = 2,
+    OP_CLASS_IMMEDIATE                    = 3,
+    OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY = 4,
+    OP_CLASS_IMMEDIATE_TO_ACCUMULATOR     = 5,
+    OP_CLASS_SEG_REG                      = 6,
+    OP_CLASS_REGISTER                     = 7,  // push ax
+    OP_CLASS_SEGMENT                      = 8,  // push es
+    OP_CLASS_ACCUMULATOR_REGISTER         = 9,  // xchg ax, cx
+    OP_CLASS_IMMEDIATE_TO_REGISTER        = 10, // mov cl, byte 12
+    OP_CLASS_ACCUMULATOR_MEMORY           = 11, // mov ax, [16]
+    OP_CLASS_ACCUMULATOR_DX               = 12, // in al, dx
+    OP_CLASS_STRING                       = 13, // rep movsb
+    OP_CLASS_JUMP                         = 14, // jne label_N
+    OP_CLASS_NEAR_RELATIVE                = 15, // call 1234
+    OP_CLASS_SHORT_RELATIVE               = 16, // jmp -2
+    OP_CLASS_FAR_POINTER                  = 17, // jmp cs:ip
+};
+
+// Kept out of the enum so switches over OpClass don't have to handle it.
+#define OP_CLASS_COUNT 18
+
+const char* op_class_names[OP_CLASS_COUNT] = {
+    "none",
+    "register_memory",
+    "register_memory_and_register",
+    "immediate",
+    "immediate_to_register_memory",
+    "immediate_to_accumulator",
+    "seg_reg",
+    "register",
+    "segment",
+    "accumulator_register",
+    "immediate_to_register",
+    "accumulator_memory",
+    "accumulator_dx",
+    "string",
+    "jump",
+    "near_relative",
+    "short_relative",
+    "far_pointer",
+};
+
+struct DecodedInstruction {
+    int address;
+    u8 length;
+    u8 opcode;           // first byte after any prefixes, rep included
+    OpClass op_class;
+    Text mnemonic;
+
+    bool lock;
+    bool rep;
+    bool has_segment_override;
+    u8 segment_override;
+    bool word;           // register operands are word sized
+    bool dir;            // reg (or accumulator) is the destination
+    bool data_word;      // immediate is word sized
+    bool is_bit_shift;
+    bool shift_by_cl;
+
+    u8 reg;              // mod/rm reg field, register operand or segment
+    bool rm_is_register;
+    u8 rm;               // register operand when rm_is_register
+    EffectiveAddress ea; // memory operand otherwise
+
+    u16 data;            // immediate, direct address or far offset
+    u16 segment;         // far pointer segment
+    int target;          // jump or call target
+};
+
+struct DecodeContext {
+    int instruction_count;
+
+    int error_address;   // first address that could not be decoded, or -1
+    u8 error_byte;
+};
+
+void init_decode_context(DecodeContext* ctx) {
+    ctx->instruction_count = 0;
+    ctx->error_address = -1;
+    ctx->error_byte = 0;
+}
+
+int extract_encoded_data(u8* bytes, int current_byte, bool extract_word, bool use_signed_immediate, u16* data) {
+    if (extract_word) {
+        if (use_signed_immediate) {
+            u8 sign = bytes[current_byte] & 0x80;
+            if (sign) {
+                *data = 0xFF00;
+            }
+            *data |= bytes[current_byte];
+            return 1;
+        }
+
+        *data = bytes[current_byte] | (bytes[current_byte + 1] << 8);
+        return 2;
+    }
+
+    *data = bytes[current_byte];
+    return 1;
+}
+
+// Decodes the instruction at code[0], which is at address in the decoded
+// image. len is how many bytes are available. Returns the instruction length,
+// or 0 if it cannot be decoded (ctx records where).
+int decode_one(DecodeContext* ctx, u8* code, int len, int address, DecodedInstruction* instruction) {
+    // Never read past the caller's buffer: a short tail is decoded from a
+    // zero padded copy and rejected below if it turns out to be truncated.
+    u8 padded[DECODE_MAX_INSTRUCTION_LENGTH];
+    if (len < DECODE_MAX_INSTRUCTION_LENGTH) {
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, code, len);
+        code = padded;
+    }
+
+    *instruction = {};
+    instruction->address = address;
+
+    int prefix_count = 0;
+    u8* bytes = code;
+
+    bool use_segment_override = false;
+    u8 segment_override = 0;
+
+    bool is_bit_shift = false;
+    u8 bit_shift_type = 0;
+
+    bool use_signed_immediate = false;
+    bool decode_register_memory = false;
+    bool extract_data = false;
+    bool extract_word = false;
+    bool use_lock = false;
+
+    OpClass op_class = OP_CLASS_NONE;
+    Text op_text = {};
+
+    if (bytes[0] == 0xF0) {
+        use_lock = true;
+        prefix_count += 1;
+        bytes = &code[prefix_count];
+    }
+
+    switch (bytes[0]) {
+        case 0x26:
+        case 0x2E:
+        case 0x36:
+        case 0x3E: {
+            use_segment_override = true;
+            segment_override = bytes[0] >> 3 & 0x03;
+            prefix_count += 1;
+            bytes = &code[prefix_count];
+        } break;
+    }
+
+    int byte_count = 0;
+
+    u8 word = bytes[0] & 0x01;
+    u8 mode = bytes[1] >> 6;
+    u8 rm   = bytes[1] & 0x07;
+    u8 dir  = bytes[0] & 0x02;
+
+    if (bytes[0] >= 0x00 && bytes[0] <= 0x3F) {
+        if ((bytes[0] & 0x06) == 0x06) {
+            if ((bytes[0] & 0xF0) <= 0x10) {
+                op_text = (bytes[0] & 0x01) ? TEXT("pop") : TEXT("push");
+                op_class = OP_CLASS_SEGMENT;
+                instruction->reg = (bytes[0] >> 3) & 0x03;
+                byte_count += 1;
+
+            } else if (bytes[0] & 0x07 == 0x07) {
+                switch ((bytes[0] >> 3) & 0x03) {
+                    case 0: op_text = TEXT("daa"); break;
+                    case 1: op_text = TEXT("das"); break;
+                    case 2: op_text = TEXT("aaa"); break;
+                    case 3: op_text = TEXT("aas"); break;
+                }
+
+                byte_count += 1;
+            }
+
+        } else {
+            op_text = group_one_mnemonics[((bytes[0] >> 3) & 0x07)];
+
+            if (bytes[0] & 0x04) {
+                op_class = OP_CLASS_IMMEDIATE_TO_ACCUMULATOR;
+                extract_data = true;
+                extract_word = word != 0;
+                byte_count += 1;
+            } else {
+                op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
+                decode_register_memory = true;
+                byte_count += 2;
+            }
+        }
+
+    } else if (bytes[0] >= 0x40 && bytes[0] <= 0x5F) {
+        const Text mnemonics[] = {
+            TEXT("inc"),
+            TEXT("dec"),
+            TEXT("push"),
+            TEXT("pop"),
+        };
+
+        op_text = mnemonics[(bytes[0] >> 3) & 0x03];
+        op_class = OP_CLASS_REGISTER;
+        instruction->reg = bytes[0] & 0x07;
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xF0) == 0x70) {
+        const Text mnemonics[] = {
+            TEXT("jo"),
+            TEXT("jno"),
+            TEXT("jb"),
+            TEXT("jnb"),
+            TEXT("je"),
+            TEXT("jne"),
+            TEXT("jbe"),
+            TEXT("jnbe"),
+            TEXT("js"),
+            TEXT("jns"),
+            TEXT("jp"),
+            TEXT("jnp"),
+            TEXT("jl"),
+            TEXT("jnl"),
+            TEXT("jle"),
+            TEXT("jnle")
+        };
+
+        op_text = mnemonics[bytes[0] & 0x0F];
+        op_class = OP_CLASS_JUMP;
+        byte_count += 2;
+
+    } else if (bytes[0] >= 0x80 && bytes[0] <= 0x82) {
+        op_class = OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY;
+        decode_register_memory = true;
+        extract_data = true;
+        extract_word = word != 0;
+        op_text = group_one_mnemonics[((bytes[1] >> 3) & 0x07)];
+        use_signed_immediate = (bytes[0] & 0b00000010) != 0;
+
+        byte_count += 2;
+
+    } else if (bytes[0] == 0x83) {
+        op_class = OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY;
+        decode_register_memory = true;
+        extract_data = true;
+        extract_word = word != 0;
+        op_text = group_one_mnemonics[((bytes[1] >> 3) & 0x07)];
+        use_signed_immediate = true;
+
+        byte_count += 2;
+
+    } else if (bytes[0] >= 0x84 && bytes[0] <= 0x87) {
+        const Text mnemonics[] = {
+            TEXT("test"),
+            TEXT("test"),
+            TEXT("xchg"),
+            TEXT("xchg")
+        };
+
+        op_text = mnemonics[(bytes[0] & 0x0F) - 0x04];
+        op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
+        decode_register_memory = true;
+
+        if (use_lock) {
+            dir = 0;
+        } else {
+            dir = bytes[0] & 0x02;
+        }
+
+        byte_count += 2;
+
+    } else if (bytes[0] >= 0x88 && bytes[0] <= 0x8B) {
+        op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
+        decode_register_memory = true;
+        op_text = TEXT("mov");
+        byte_count += 2;
+
+    } else if (bytes[0] == 0x8C || bytes[0] == 0x8E) {
+        op_class = OP_CLASS_SEG_REG;
+        decode_register_memory = true;
+        op_text = TEXT("mov");
+        byte_count += 2;
+
+    } else if (bytes[0] == 0x8D) {
+        op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
+        decode_register_memory = true;
+        op_text = TEXT("lea");
+        dir = 1;
+        byte_count += 2;
+
+    } else if (bytes[0] == 0x8F) {
+        op_class = OP_CLASS_REGISTER_MEMORY;
+        decode_register_memory = true;
+        op_text = TEXT("pop");
+        byte_count += 2;
+
+    } else if (bytes[0] >= 0x90 && bytes[0] <= 0x97) {
+        op_text = TEXT("xchg");
+        op_class = OP_CLASS_ACCUMULATOR_REGISTER;
+        instruction->reg = bytes[0] & 0x07;
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xFE) == 0x98) {
+        op_text = (bytes[0] & 0x01) ? TEXT("cwd") : TEXT("cbw");
+        byte_count += 1;
+
+    } else if (bytes[0] == 0x9A) {
+        op_text = TEXT("call");
+        op_class = OP_CLASS_FAR_POINTER;
+        instruction->data    = bytes[1] | (bytes[2] << 8);
+        instruction->segment = bytes[3] | (bytes[4] << 8);
+        byte_count += 5;
+
+    } else if (bytes[0] == 0x9B) {
+        op_text = TEXT("wait");
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xFC) == 0x9C) {
+        const Text mnemonics[] = {
+            TEXT("pushf"),
+            TEXT("popf"),
+            TEXT("sahf"),
+            TEXT("lahf"),
+        };
+
+        op_text = mnemonics[bytes[0] & 0x03];
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xFC) == 0xA0) {
+        op_text = TEXT("mov");
+        op_class = OP_CLASS_ACCUMULATOR_MEMORY;
+        instruction->data = bytes[1] | bytes[2] << 8;
+        byte_count += 3;
+
+    } else if ((bytes[0] & 0xFE) == 0xA8) {
+        extract_data = true;
+        extract_word = word != 0;
+        op_class = OP_CLASS_IMMEDIATE_TO_ACCUMULATOR;
+        op_text = TEXT("test");
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xFC) == 0xA4 || (bytes[0] & 0xFC) == 0xAC) {
+        if (bytes[0] & 0x08) {
+            op_text = (bytes[0] & 0x02) ? TEXT("lods") : TEXT("scas");
+        } else {
+            op_text = (bytes[0] & 0x02) ? TEXT("movs") : TEXT("cmps");
+        }
+
+        op_class = OP_CLASS_STRING;
+        word = bytes[0] & 0x01;
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xF0) == 0xB0) {
+        op_text = TEXT("mov");
+        op_class = OP_CLASS_IMMEDIATE_TO_REGISTER;
+        instruction->reg = bytes[0] & 0x07;
+        word = (bytes[0] & 0x08) != 0;
+        extract_data = true;
+        extract_word = word != 0;
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xFE) == 0xC2) {
+        u8 no_immediate = bytes[0] & 0x01;
+        op_text = TEXT("ret");
+
+        if (no_immediate) {
+            byte_count += 1;
+        } else {
+            extract_data = true;
+            extract_word = true;
+            byte_count += 1;
+            op_class = OP_CLASS_IMMEDIATE;
+        }
+
+    } else if ((bytes[0] & 0xFE) == 0xC4) {
+        op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
+        decode_register_memory = true;
+        op_text = (bytes[0] & 0x01) ? TEXT("lds") : TEXT("les");
+        word = 1;
+        dir = 1;
+        byte_count += 2;
+
+    } else if ((bytes[0] & 0xFE) == 0xC6) {
+        op_class = OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY;
+        decode_register_memory = true;
+        extract_data = true;
+        extract_word = word != 0;
+        op_text = TEXT("mov");
+        byte_count += 2;
+
+    } else if ((bytes[0] & 0xFE) == 0xCA) {
+        op_text = TEXT("retf");
+
+        if (bytes[0] & 0x01) {
+            byte_count += 1;
+        } else {
+            extract_data = true;
+            extract_word = true;
+            byte_count += 1;
+            op_class = OP_CLASS_IMMEDIATE;
+        }
+
+    } else if ((bytes[0] & 0xFC) == 0xCC) {
+        const Text mnemonics[] = {
+            TEXT("int3"),
+            TEXT("int"),
+            TEXT("into"),
+            TEXT("iret")
+        };
+
+        u8 op = bytes[0] & 0x03;
+        op_text = mnemonics[op];
+
+        if (op == 1) {
+            extract_data = true;
+            extract_word = false;
+            op_class = OP_CLASS_IMMEDIATE;
+        }
+
+        byte_count += 1;
+
+    } else if (bytes[0] >= 0xD0 && bytes[0] <= 0xD3) {
+        const Text mnemonics[] = {
+            TEXT("rol"),
+            TEXT("ror"),
+            TEXT("rcl"),
+            TEXT("rcr"),
+            TEXT("shl"), // "sal"
+            TEXT("shr"),
+            TEXT("unused"),
+            TEXT("sar")
+        };
+
+        op_text = mnemonics[(bytes[1] >> 3) & 0x07];
+        op_class = OP_CLASS_REGISTER_MEMORY;
+        decode_register_memory = true;
+        is_bit_shift = true;
+        bit_shift_type = bytes[0] & 0x02;
+
+        byte_count += 2;
+
+    } else if ((bytes[0] & 0xFC) == 0xD4) {
+        const Text mnemonics[] = {
+            TEXT("aam"),
+            TEXT("aad"),
+            TEXT("unused"),
+            TEXT("xlat"),
+        };
+
+        u8 index = bytes[0] & 0x03;
+        op_text = mnemonics[index];
+
+        if (index >= 2) {
+            byte_count += 1;
+        } else {
+            byte_count += 2;
+        }
+
+    } else if ((bytes[0] & 0xFC) == 0xE0) {
+        const Text mnemonics[] = {
+            TEXT("loopnz"),
+            TEXT("loopz"),
+            TEXT("loop"),
+            TEXT("jcxz"),
+        };
+
+        op_text = mnemonics[bytes[0] & 0x03];
+        op_class = OP_CLASS_JUMP;
+        byte_count += 2;
+
+    } else if (bytes[0] >= 0xE4 && bytes[0] <= 0xE7) {
+        op_text = (bytes[0] & 0x2) ? TEXT("out") : TEXT("in");
+        op_class = OP_CLASS_IMMEDIATE_TO_ACCUMULATOR;
+
+        extract_data = true;
+        extract_word = false;
+
+        word = bytes[0] & 0x01;
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xFE) == 0xE8) {
+        op_text = (bytes[0] & 0x01) ? TEXT("jmp") : TEXT("call");
+        op_class = OP_CLASS_NEAR_RELATIVE;
+
+        short disp = bytes[1] | (bytes[2] << 8);
+        short next_ip = address + 3 + disp;
+        instruction->target = next_ip;
+        byte_count += 3;
+
+    } else if (bytes[0] == 0xEA) {
+        op_text = TEXT("jmp");
+        op_class = OP_CLASS_FAR_POINTER;
+        instruction->data    = bytes[1] | (bytes[2] << 8);
+        instruction->segment = bytes[3] | (bytes[4] << 8);
+        byte_count += 5;
+
+    } else if (bytes[0] == 0xEB) {
+        op_text = TEXT("jmp");
+        op_class = OP_CLASS_SHORT_RELATIVE;
+        byte_count += 2;
+
+    } else if (bytes[0] >= 0xEC && bytes[0] <= 0xEF) {
+        dir = bytes[0] & 0x02;
+        op_text = dir ? TEXT("out") : TEXT("in");
+        op_class = OP_CLASS_ACCUMULATOR_DX;
+        byte_count += 1;
+
+    } else if (bytes[0] == 0xF3) {
+        if ((bytes[1] & 0xFE) == 0xAA) {
+            op_text = TEXT("stos");
+        } else if (bytes[1] & 0x08) {
+            op_text = (bytes[1] & 0x02) ? TEXT("scas") : TEXT("lods");
+        } else {
+            op_text = (bytes[1] & 0x02) ? TEXT("cmps") : TEXT("movs");
+        }
+
+        op_class = OP_CLASS_STRING;
+        instruction->rep = true;
+        word = bytes[1] & 0x01;
+        byte_count += 2;
+
+    } else if ((bytes[0] & 0xFE) == 0xF4) {
+        op_text = (bytes[0] & 0x01) ? TEXT("cmc") : TEXT("hlt");
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xFE) == 0xF6) {
+        const Text mnemonics[] = {
+            TEXT("test"),
+            TEXT("unused"),
+            TEXT("not"),
+            TEXT("neg"),
+            TEXT("mul"),
+            TEXT("imul"),
+            TEXT("div"),
+            TEXT("idiv"),
+        };
+
+        u8 op = (bytes[1] >> 3) & 0x07;
+
+        if (op == 0) {
+            extract_data = true;
+            extract_word = word != 0;
+            op_class = OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY;
+        } else {
+            op_class = OP_CLASS_REGISTER_MEMORY;
+        }
+
+        decode_register_memory = true;
+        op_text = mnemonics[op];
+        byte_count += 2;
+
+    } else if (bytes[0] >= 0xF8 && bytes[0] <= 0xFD) {
+        u8 op = bytes[0] & 0x07;
+
+        const Text mnemonics[] = {
+            TEXT("clc"),
+            TEXT("stc"),
+            TEXT("cli"),
+            TEXT("sti"),
+            TEXT("cld"),
+            TEXT("std")
+        };
+
+        op_text = mnemonics[op];
+        byte_count += 1;
+
+    } else if ((bytes[0] & 0xFE) == 0xFE) {
+        const Text mnemonics[] = {
+            TEXT("inc"),
+            TEXT("dec"),
+            TEXT("call"),
+            TEXT("call far"),
+            TEXT("jmp"),
+            TEXT("jmp far"),
+            TEXT("push"),
+            TEXT("unused")
+        };
+
+        op_class = OP_CLASS_REGISTER_MEMORY;
+        decode_register_memory = true;
+        op_text = mnemonics[(bytes[1] >> 3) & 0x07];
+        byte_count += 2;
+    }
+
+    if (op_text.text == 0) {
+        ctx->error_address = address;
+        ctx->error_byte = bytes[0];
+        return 0;
+    }
+
+    if (decode_register_memory) {
+        instruction->reg = (bytes[1] & 0x38) >> 3;
+
+        if (mode == MODE_REGISTER) {
+            instruction->rm_is_register = true;
+            instruction->rm = rm;
+        } else {
+            byte_count += decode_effective_address(&bytes[1], &instruction->ea, use_segment_override, segment_override);
+        }
+    }
+
+    if (extract_data) {
+        byte_count += extract_encoded_data(bytes, byte_count, extract_word, use_signed_immediate, &instruction->data);
+    }
+
+    switch (op_class) {
+        case OP_CLASS_SEG_REG: {
+            instruction->reg = (bytes[1] >> 3) & 0x03;
+        } break;
+
+        case OP_CLASS_JUMP:
+        case OP_CLASS_SHORT_RELATIVE: {
+            instruction->target = address + prefix_count + byte_count + (char)bytes[1];
+        } break;
+
+        default: {
+        } break;
+    }
+
+    int length = prefix_count + byte_count;
+    if (length > len) {
+        ctx->error_address = address;
+        ctx->error_byte = bytes[0];
+        return 0;
+    }
+
+    instruction->length = (u8)length;
+    instruction->opcode = instruction->rep ? bytes[1] : bytes[0];
+    instruction->op_class = op_class;
+    instruction->mnemonic = op_text;
+    instruction->lock = use_lock;
+    instruction->has_segment_override = use_segment_override;
+    instruction->segment_override = segment_override;
+    instruction->word = word != 0;
+    instruction->dir = dir != 0;
+    instruction->data_word = extract_word;
+    instruction->is_bit_shift = is_bit_shift;
+    instruction->shift_by_cl = bit_shift_type != 0;
+
+    ctx->instruction_count += 1;
+    return length;
+}
+
+// Decodes len bytes of code starting at address 0 and hands each instruction
+// to the sink in order. Stops at the first undecodable instruction and
+// returns false; ctx says where.
+//
+// A sink is a type with a static emit(Sink*, DecodedInstruction*). Each one
+// gets its own copy of the loop with emit() inlined (see sinks.h).
+template <typename Sink>
+bool decode(DecodeContext* ctx, u8* bytes, int len, Sink* sink) {
+    DecodedInstruction instruction;
+
+    for (int i = 0; i < len;) {
+        int length = decode_one(ctx, &bytes[i], len - i, i, &instruction);
+        if (length == 0) {
+            return false;
+        }
+
+        Sink::emit(sink, &instruction);
+        i += length;
+    }
+
+    return true;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+// Effective address forms for the mod/rm memory modes.
+//
+// Each (mode, rm) pair gets a precomputed form: a kernel that computes the
+// offset from the registers with no further branching, the displacement
+// size, the segment used when there is no override and the 8086 EA clocks.
+// The decoder resolves a form once per instruction and anything executing
+// the instruction just calls its kernel.
+
+#include "utility.h"
+
+enum Register {
+    REGISTER_AX = 0,
+    REGISTER_CX = 1,
+    REGISTER_DX = 2,
+    REGISTER_BX = 3,
+    REGISTER_SP = 4,
+    REGISTER_BP = 5,
+    REGISTER_SI = 6,
+    REGISTER_DI = 7,
+};
+
+enum Segment {
+    SEGMENT_ES = 0,
+    SEGMENT_CS = 1,
+    SEGMENT_SS = 2,
+    SEGMENT_DS = 3,
+};
+
+typedef u16 (*EffectiveAddressKernel) (u16* registers, u16 displacement);
+
+u16 ea_bx_si(u16* r, u16 d) { return r[REGISTER_BX] + r[REGISTER_SI] + d; }
+u16 ea_bx_di(u16* r, u16 d) { return r[REGISTER_BX] + r[REGISTER_DI] + d; }
+u16 ea_bp_si(u16* r, u16 d) { return r[REGISTER_BP] + r[REGISTER_SI] + d; }
+u16 ea_bp_di(u16* r, u16 d) { return r[REGISTER_BP] + r[REGISTER_DI] + d; }
+u16 ea_si   (u16* r, u16 d) { return r[REGISTER_SI] + d; }
+u16 ea_di   (u16* r, u16 d) { return r[REGISTER_DI] + d; }
+u16 ea_bp   (u16* r, u16 d) { return r[REGISTER_BP] + d; }
+u16 ea_bx   (u16* r, u16 d) { return r[REGISTER_BX] + d; }
+u16 ea_direct(u16*,   u16 d) { return d; }
+
+struct EffectiveAddressForm {
+    EffectiveAddressKernel kernel;
+    u8 displacement_size;
+    u8 default_segment;
+    u8 clocks;
+    bool uses_registers;   // false only for the direct [disp16] form
+};
+
+// Indexed by [mode][rm] for the three memory modes.
+const EffectiveAddressForm effective_address_forms[3][8] = {
+    { // MODE_MEMORY_NO_DISPLACEMENT
+        { ea_bx_si,  0, SEGMENT_DS,  7, true  },
+        { ea_bx_di,  0, SEGMENT_DS,  8, true  },
+        { ea_bp_si,  0, SEGMENT_SS,  8, true  },
+        { ea_bp_di,  0, SEGMENT_SS,  7, true  },
+        { ea_si,     0, SEGMENT_DS,  5, true  },
+        { ea_di,     0, SEGMENT_DS,  5, true  },
+        { ea_direct, 2, SEGMENT_DS,  6, false },
+        { ea_bx,     0, SEGMENT_DS,  5, true  },
+    },
+    { // MODE_MEMORY_8_BIT_DISPLACEMENT
+        { ea_bx_si,  1, SEGMENT_DS, 11, true  },
+        { ea_bx_di,  1, SEGMENT_DS, 12, true  },
+        { ea_bp_si,  1, SEGMENT_SS, 12, true  },
+        { ea_bp_di,  1, SEGMENT_SS, 11, true  },
+        { ea_si,     1, SEGMENT_DS,  9, true  },
+        { ea_di,     1, SEGMENT_DS,  9, true  },
+        { ea_bp,     1, SEGMENT_SS,  9, true  },
+        { ea_bx,     1, SEGMENT_DS,  9, true  },
+    },
+    { // MODE_MEMORY_16_BIT_DISPLACEMENT
+        { ea_bx_si,  2, SEGMENT_DS, 11, true  },
+        { ea_bx_di,  2, SEGMENT_DS, 12, true  },
+        { ea_bp_si,  2, SEGMENT_SS, 12, true  },
+        { ea_bp_di,  2, SEGMENT_SS, 11, true  },
+        { ea_si,     2, SEGMENT_DS,  9, true  },
+        { ea_di,     2, SEGMENT_DS,  9, true  },
+        { ea_bp,     2, SEGMENT_SS,  9, true  },
+        { ea_bx,     2, SEGMENT_DS,  9, true  },
+    },
+};
+
+// Segment overrides cost two extra clocks on top of the form's EA time.
+#define SEGMENT_OVERRIDE_CLOCKS 2
+
+struct EffectiveAddress {
+    const EffectiveAddressForm* form;
+    u8 rm;
+    u8 segment;
+    bool has_segment_override;
+    short displacement;
+};
+
+// Resolves the memory operand described by a mod/rm byte (bytes[0]) and the
+// displacement following it. Returns the number of displacement bytes.
+inline int decode_effective_address(u8* bytes, EffectiveAddress* ea, bool use_segment_override = false, u8 segment_override = 0) {
+    u8 mode = bytes[0] >> 6;
+    u8 rm   = bytes[0] & 0x07;
+
+    const EffectiveAddressForm* form = &effective_address_forms[mode][rm];
+    ea->form = form;
+    ea->rm = rm;
+    ea->has_segment_override = use_segment_override;
+    ea->segment = use_segment_override ? segment_override : form->default_segment;
+
+    if (form->displacement_size == 2) {
+        ea->displacement = (short)(bytes[1] | (bytes[2] << 8));
+    } else if (form->displacement_size == 1) {
+        ea->displacement = (char)bytes[1];
+    } else {
+        ea->displacement = 0;
+    }
+
+    return form->displacement_size;
+}
+
+inline u16 effective_address_offset(EffectiveAddress* ea, u16* registers) {
+    return ea->form->kernel(registers, (u16)ea->displacement);
+}
+
+inline u32 effective_address_physical(EffectiveAddress* ea, u16* registers, u16* segment_registers) {
+    u32 base = (u32)segment_registers[ea->segment] << 4;
+    return (base + effective_address_offset(ea, registers)) & 0xFFFFF;
+}
+
+inline int effective_address_clocks(EffectiveAddress* ea) {
+    return ea->form->clocks + (ea->has_segment_override ? SEGMENT_OVERRIDE_CLOCKS : 0);
+}
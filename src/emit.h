@@ -0,0 +1,188 @@
+#pragma once
+
+// Writes the finished listing from the InstructionStore.
+//
+// Instead of printing line by line, the listing is laid out in one buffer
+// and written with a single fwrite. Instructions are split into ranges, one
+// per worker thread:
+//
+//   1. each worker measures its instructions, label lines included
+//   2. a prefix sum over the range totals gives every range its offset
+//   3. each worker renders its range straight into its part of the buffer
+//
+// The store keeps each line's length but not its text. Measuring only sums
+// those lengths; rendering decodes the instruction again from the file
+// bytes and writes its line in place, so no text is held in between.
+//
+// A label line is printed for the leading run of sorted labels that land on
+// an instruction; the first one that doesn't stops all labels after it.
+// That is the rule the line by line loop followed, worked out up front so
+// each range can find its labels without seeing the ones before it.
+
+#include <thread>
+
+#include "decoder.h"
+#include "format.h"
+#include "instruction_store.h"
+
+#define EMIT_MAX_THREADS 16
+
+// Fewer instructions per worker than this isn't worth a thread.
+#define EMIT_MIN_RANGE 16384
+
+struct EmitJob {
+    InstructionStore* store;
+    u8* code;             // the bytes the store was decoded from
+    int code_size;
+    int* labels;          // sorted label addresses, all of them printed
+    int label_count;
+    char* output;
+};
+
+struct EmitRange {
+    EmitJob* job;
+    int begin;
+    int end;
+    int first_label;      // first label at or after instruction begin
+    u64 size;             // bytes the range renders to
+    u64 offset;           // where the range starts in the output
+};
+
+inline int label_line_length(int address) {
+    // "label_" + digits + ":\n"
+    return 6 + decimal_length((u32)address) + 2;
+}
+
+// Index of the first address in a sorted array that is >= value.
+int lower_bound(int* values, int count, int value) {
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (values[middle] < value) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void measure_range(EmitRange* range) {
+    EmitJob* job = range->job;
+    InstructionStore* store = job->store;
+
+    range->first_label = lower_bound(job->labels, job->label_count, (int)store->addresses[range->begin]);
+    int label = range->first_label;
+
+    u64 size = 0;
+    for (int i = range->begin; i < range->end; i++) {
+        int address = (int)store->addresses[i];
+        if (label < job->label_count && job->labels[label] == address) {
+            size += label_line_length(address);
+            label++;
+        }
+
+        size += store->text_lengths[i];
+    }
+    range->size = size;
+}
+
+void render_range(EmitRange* range) {
+    EmitJob* job = range->job;
+    InstructionStore* store = job->store;
+
+    DecodeContext ctx;
+    init_decode_context(&ctx);
+    DecodedInstruction instruction;
+
+    char* out = job->output + range->offset;
+    int label = range->first_label;
+    for (int i = range->begin; i < range->end; i++) {
+        int address = (int)store->addresses[i];
+        if (label < job->label_count && job->labels[label] == address) {
+            out = append_text(out, TEXT("label_"));
+            out = append_u32(out, (u32)address);
+            out = append_text(out, TEXT(":\n"));
+            label++;
+        }
+
+        // Every address in the store decoded once already, so this can't fail.
+        decode_one(&ctx, &job->code[address], job->code_size - address, address, &instruction);
+        out = append_instruction(out, &instruction);
+    }
+}
+
+void run_ranges(void (*work)(EmitRange*), EmitRange* ranges, int count) {
+    std::thread threads[EMIT_MAX_THREADS];
+    for (int i = 1; i < count; i++) {
+        threads[i] = std::thread(work, &ranges[i]);
+    }
+    work(&ranges[0]);
+    for (int i = 1; i < count; i++) {
+        threads[i].join();
+    }
+}
+
+// Writes "bits 16" and the listing of code, as decoded into store, to
+// stream. labels must be sorted and free of duplicates. Returns how many
+// label lines were printed.
+int emit_listing(InstructionStore* store, u8* code, int code_size, int* labels, int label_count, FILE* stream) {
+    // Labels past the first one that misses every instruction never print.
+    int printed = 0;
+    while (printed < label_count) {
+        int index = lower_bound((int*)store->addresses, store->count, labels[printed]);
+        if (labels[printed] < 0 || index == store->count || (int)store->addresses[index] != labels[printed]) {
+            break;
+        }
+        printed++;
+    }
+
+    Text header = TEXT("bits 16\n");
+    if (store->count == 0) {
+        fwrite(header.text, 1, header.length, stream);
+        return printed;
+    }
+
+    int thread_count = (int)std::thread::hardware_concurrency();
+    int useful = (store->count + EMIT_MIN_RANGE - 1) / EMIT_MIN_RANGE;
+    if (thread_count > useful)           thread_count = useful;
+    if (thread_count > EMIT_MAX_THREADS) thread_count = EMIT_MAX_THREADS;
+    if (thread_count < 1)                thread_count = 1;
+
+    EmitJob job = {};
+    job.store = store;
+    job.code = code;
+    job.code_size = code_size;
+    job.labels = labels;
+    job.label_count = printed;
+
+    EmitRange ranges[EMIT_MAX_THREADS];
+    for (int i = 0; i < thread_count; i++) {
+        ranges[i] = {};
+        ranges[i].job = &job;
+        ranges[i].begin = (int)((u64)store->count * i / thread_count);
+        ranges[i].end = (int)((u64)store->count * (i + 1) / thread_count);
+    }
+
+    run_ranges(measure_range, ranges, thread_count);
+
+    u64 total = header.length;
+    for (int i = 0; i < thread_count; i++) {
+        ranges[i].offset = total;
+        total += ranges[i].size;
+    }
+
+    job.output = (char*)malloc(total);
+    if (job.output == 0) {
+        critical_error("Failed to allocate %llu bytes for the listing.", (unsigned long long)total);
+    }
+    memcpy(job.output, header.text, header.length);
+
+    run_ranges(render_range, ranges, thread_count);
+
+    fwrite(job.output, 1, total, stream);
+
+    free(job.output);
+    return printed;
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+// NASM style text for decoded instructions.
+//
+// Lines are written straight into the caller's buffer. Every fixed string
+// comes from a Text table with its length, and numbers go through
+// append_u32(), which converts two digits per step from a lookup table, so
+// no printf formatting is involved.
+
+#include "decoder.h"
+
+// Longest line render_instruction() can produce, including the terminator.
+#define MAX_INSTRUCTION_TEXT 64
+
+const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+inline int decimal_length(u32 value) {
+    return 1 + (value >= 10) + (value >= 100) + (value >= 1000) + (value >= 10000) +
+           (value >= 100000) + (value >= 1000000) + (value >= 10000000) +
+           (value >= 100000000) + (value >= 1000000000);
+}
+
+inline char* append_u32(char* out, u32 value) {
+    char* end = out + decimal_length(value);
+    char* p = end;
+
+    while (value >= 100) {
+        u32 pair = (value % 100) * 2;
+        value /= 100;
+        p -= 2;
+        p[0] = digit_pairs[pair];
+        p[1] = digit_pairs[pair + 1];
+    }
+
+    if (value >= 10) {
+        p[-2] = digit_pairs[value * 2];
+        p[-1] = digit_pairs[value * 2 + 1];
+    } else {
+        p[-1] = (char)('0' + value);
+    }
+
+    return end;
+}
+
+inline char* append_i32(char* out, int value) {
+    if (value < 0) {
+        *out++ = '-';
+        return append_u32(out, 0u - (u32)value);
+    }
+    return append_u32(out, (u32)value);
+}
+
+inline char* append_text(char* out, Text text) {
+    memcpy(out, text.text, text.length);
+    return out + text.length;
+}
+
+inline char* append_char(char* out, char c) {
+    *out = c;
+    return out + 1;
+}
+
+inline char* append_address_operand(char* out, DecodedInstruction* instruction) {
+    if (instruction->rm_is_register) {
+        const Text* reg_table = instruction->word ? register_map_word : register_map_byte;
+        return append_text(out, reg_table[instruction->rm]);
+    }
+
+    EffectiveAddress* ea = &instruction->ea;
+    if (ea->has_segment_override) {
+        out = append_text(out, segments[ea->segment]);
+        out = append_char(out, ':');
+    }
+
+    out = append_char(out, '[');
+
+    if (ea->form->uses_registers) {
+        out = append_text(out, effective_address_table[ea->rm]);
+    }
+
+    if (ea->displacement != 0) {
+        out = append_text(out, TEXT(" + "));
+        out = append_i32(out, ea->displacement);
+    }
+
+    return append_char(out, ']');
+}
+
+// Writes the full line for an instruction, newline included but not
+// terminated, and returns the end. Needs MAX_INSTRUCTION_TEXT - 1 bytes.
+char* append_instruction(char* out, DecodedInstruction* instruction) {
+    if (instruction->lock) {
+        out = append_text(out, TEXT("lock "));
+    }
+
+    if (instruction->rep) {
+        out = append_text(out, TEXT("rep "));
+    }
+
+    out = append_text(out, instruction->mnemonic);
+
+    Text reg = instruction->word ? TEXT("ax") : TEXT("al");
+    Text size_label = instruction->data_word ? TEXT("word ") : TEXT("byte ");
+    const Text* reg_table = instruction->word ? register_map_word : register_map_byte;
+    u16 data = instruction->data;
+
+    switch (instruction->op_class) {
+        case OP_CLASS_NONE: {
+        } break;
+
+        case OP_CLASS_SEG_REG: {
+            out = append_char(out, ' ');
+            out = append_address_operand(out, instruction);
+            out = append_text(out, TEXT(", "));
+            out = append_text(out, segments[instruction->reg]);
+        } break;
+
+        case OP_CLASS_IMMEDIATE: {
+            out = append_char(out, ' ');
+            out = append_text(out, size_label);
+            out = append_u32(out, data);
+        } break;
+
+        case OP_CLASS_REGISTER_MEMORY: {
+            out = append_text(out, instruction->word ? TEXT(" word ") : TEXT(" byte "));
+            out = append_address_operand(out, instruction);
+
+            if (instruction->is_bit_shift) {
+                out = append_text(out, instruction->shift_by_cl ? TEXT(", cl") : TEXT(", 1"));
+            }
+        } break;
+
+        case OP_CLASS_REGISTER_MEMORY_AND_REGISTER: {
+            out = append_char(out, ' ');
+            if (instruction->dir) {
+                out = append_text(out, reg_table[instruction->reg]);
+                out = append_text(out, TEXT(", "));
+                out = append_address_operand(out, instruction);
+            } else {
+                out = append_address_operand(out, instruction);
+                out = append_text(out, TEXT(", "));
+                out = append_text(out, reg_table[instruction->reg]);
+            }
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY: {
+            out = append_char(out, ' ');
+            out = append_address_operand(out, instruction);
+            out = append_text(out, TEXT(", "));
+            out = append_text(out, size_label);
+            out = append_u32(out, data);
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_ACCUMULATOR: {
+            out = append_char(out, ' ');
+            if (instruction->dir) {
+                out = append_text(out, size_label);
+                out = append_u32(out, data);
+                out = append_text(out, TEXT(", "));
+                out = append_text(out, reg);
+            } else {
+                out = append_text(out, reg);
+                out = append_text(out, TEXT(", "));
+                out = append_text(out, size_label);
+                out = append_u32(out, data);
+            }
+        } break;
+
+        case OP_CLASS_REGISTER: {
+            out = append_char(out, ' ');
+            out = append_text(out, register_map_word[instruction->reg]);
+        } break;
+
+        case OP_CLASS_SEGMENT: {
+            out = append_char(out, ' ');
+            out = append_text(out, segments[instruction->reg]);
+        } break;
+
+        case OP_CLASS_ACCUMULATOR_REGISTER: {
+            out = append_text(out, TEXT(" ax, "));
+            out = append_text(out, register_map_word[instruction->reg]);
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER: {
+            out = append_char(out, ' ');
+            out = append_text(out, reg_table[instruction->reg]);
+            out = append_text(out, TEXT(", "));
+            out = append_text(out, size_label);
+            out = append_u32(out, data);
+        } break;
+
+        case OP_CLASS_ACCUMULATOR_MEMORY: {
+            out = append_char(out, ' ');
+            if (instruction->dir) {
+                out = append_char(out, '[');
+                out = append_i32(out, (short)data);
+                out = append_text(out, TEXT("], "));
+                out = append_text(out, reg);
+            } else {
+                out = append_text(out, reg);
+                out = append_text(out, TEXT(", ["));
+                out = append_i32(out, (short)data);
+                out = append_char(out, ']');
+            }
+        } break;
+
+        case OP_CLASS_ACCUMULATOR_DX: {
+            out = append_char(out, ' ');
+            if (instruction->dir) {
+                out = append_text(out, TEXT("dx, "));
+                out = append_text(out, reg);
+            } else {
+                out = append_text(out, reg);
+                out = append_text(out, TEXT(", dx"));
+            }
+        } break;
+
+        case OP_CLASS_STRING: {
+            out = append_char(out, instruction->word ? 'w' : 'b');
+        } break;
+
+        case OP_CLASS_JUMP: {
+            out = append_text(out, TEXT(" label_"));
+            out = append_i32(out, instruction->target);
+        } break;
+
+        // Near targets wrap at 16 bits and short ones print the displacement,
+        // both signed.
+        case OP_CLASS_NEAR_RELATIVE: {
+            out = append_char(out, ' ');
+            out = append_i32(out, instruction->target);
+        } break;
+
+        case OP_CLASS_SHORT_RELATIVE: {
+            int displacement = instruction->target - (instruction->address + instruction->length);
+            out = append_char(out, ' ');
+            out = append_i32(out, displacement);
+        } break;
+
+        case OP_CLASS_FAR_POINTER: {
+            out = append_char(out, ' ');
+            out = append_u32(out, instruction->segment);
+            out = append_char(out, ':');
+            out = append_u32(out, data);
+        } break;
+    }
+
+    return append_char(out, '\n');
+}
+
+// Like append_instruction() but terminates the line and returns its length.
+// buffer needs MAX_INSTRUCTION_TEXT bytes.
+int render_instruction(DecodedInstruction* instruction, char* buffer) {
+    char* out = append_instruction(buffer, instruction);
+    *out = 0;
+
+    return (int)(out - buffer);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+// Columnar storage for decoded instructions.
+//
+// Every attribute lives in its own dense array so a pass that only needs one
+// of them (the label pass only reads jump targets, emit's measure pass only
+// text lengths) streams through packed memory instead of striding over whole
+// instructions. Jump targets are only
+// stored for jumps; jump_bits says which instructions own the next entry.
+//
+// Columns are allocated from an arena. reserve_instruction_store() sizes
+// them once when the count is known up front; otherwise they grow by
+// doubling and, since the bump arena never frees, the old columns are simply
+// left behind.
+
+#include "utility.h"
+
+#define INSTRUCTION_STORE_INITIAL_CAPACITY 4096
+
+struct InstructionStore {
+    MemoryArena* arena;
+
+    int count;
+    int capacity;
+
+    u32* addresses;      // an instruction's length is the gap to the next one
+    u8*  text_lengths;   // rendered length of the line, newline included
+    u64* jump_bits;      // bit i is set when instruction i is a jump
+
+    int  jump_count;
+    int  jump_capacity;
+    int* jump_targets;   // one per jump, in instruction order
+};
+
+template <typename T>
+T* grow_column(MemoryArena* arena, T* column, int count, int new_capacity) {
+    T* grown = (T*)arena_alloc(arena, new_capacity * sizeof(T));
+    if (count > 0) {
+        memcpy(grown, column, count * sizeof(T));
+    }
+    return grown;
+}
+
+void init_instruction_store(InstructionStore* store, MemoryArena* arena) {
+    *store = {};
+    store->arena = arena;
+}
+
+void resize_instruction_columns(InstructionStore* store, int capacity) {
+    capacity = (capacity + 63) & ~63;
+
+    int bit_words     = store->capacity / 64;
+    int new_bit_words = capacity / 64;
+
+    store->addresses    = grow_column(store->arena, store->addresses,    store->count, capacity);
+    store->text_lengths = grow_column(store->arena, store->text_lengths, store->count, capacity);
+    store->jump_bits    = grow_column(store->arena, store->jump_bits,    bit_words,    new_bit_words);
+    memset(store->jump_bits + bit_words, 0, (new_bit_words - bit_words) * sizeof(u64));
+
+    store->capacity = capacity;
+}
+
+void resize_jump_column(InstructionStore* store, int capacity) {
+    store->jump_targets  = grow_column(store->arena, store->jump_targets, store->jump_count, capacity);
+    store->jump_capacity = capacity;
+}
+
+// Sizes an empty store for the given number of instructions and jumps.
+void reserve_instruction_store(InstructionStore* store, int capacity, int jump_capacity) {
+    resize_instruction_columns(store, capacity > 0 ? capacity : 1);
+    resize_jump_column(store, jump_capacity > 0 ? jump_capacity : 1);
+}
+
+int push_instruction(InstructionStore* store, int address, u8 text_length) {
+    if (store->count == store->capacity) {
+        resize_instruction_columns(store, store->capacity ? store->capacity * 2 : INSTRUCTION_STORE_INITIAL_CAPACITY);
+    }
+
+    int index = store->count;
+    store->count += 1;
+
+    store->addresses[index]    = address;
+    store->text_lengths[index] = text_length;
+    return index;
+}
+
+void push_jump(InstructionStore* store, int index, int jump_address) {
+    if (store->jump_count == store->jump_capacity) {
+        resize_jump_column(store, store->jump_capacity ? store->jump_capacity * 2 : INSTRUCTION_STORE_INITIAL_CAPACITY / 4);
+    }
+
+    store->jump_bits[index >> 6] |= 1ull << (index & 63);
+    store->jump_targets[store->jump_count] = jump_address;
+    store->jump_count += 1;
+}
+
+inline bool is_jump(InstructionStore* store, int index) {
+    return (store->jump_bits[index >> 6] >> (index & 63)) & 1;
+}
@@ -0,0 +1,442 @@
+#pragma once
+
+// Lockstep simulation of one program over many machine states.
+//
+// A LaneGroup runs LANE_COUNT machines through the same instruction stream.
+// Their general registers and flags live in register-major arrays, one SSE2
+// vector per register, so word sized register arithmetic runs for every
+// lane in a single vector operation, flags included. Everything else (memory
+// operands, byte registers, string ops...) goes through execute() once per
+// lane, against that lane's own Simulator and memory.
+//
+// All lanes must hold the same code; instructions are decoded once, from the
+// leader (the lowest active lane). When lanes disagree on where to go next,
+// the ones that do not follow the leader are parked: their state is written
+// back to their Simulator and they finish on the scalar run() loop after the
+// lockstep part is done.
+
+#include <emmintrin.h>
+
+#include "simulator.h"
+
+#define LANE_COUNT 8
+
+// CF, PF, AF, ZF, SF and OF.
+#define ARITHMETIC_FLAGS 0x08D5
+
+typedef __m128i LaneVector;
+
+struct LaneGroup {
+    alignas(16) u16 registers[8][LANE_COUNT];  // [Register][lane]
+    alignas(16) u16 flags[LANE_COUNT];
+    u16 ip;                                    // shared while in lockstep
+
+    u32 active;                                // lanes still in lockstep
+    u32 parked;                                // lanes that diverged
+    u64 steps;                                 // instructions run in lockstep
+
+    u64 vector_steps;                          // ...of which all lanes at once
+    u64 scalar_steps;                          // ...of which lane by lane
+
+    Simulator lanes[LANE_COUNT];               // memory, segments and the scalar path
+    StopReason lane_stops[LANE_COUNT];
+};
+
+void init_lane_group(LaneGroup* group, MemoryArena* arena) {
+    memset(group, 0, sizeof(LaneGroup));
+    for (int i = 0; i < LANE_COUNT; i++) {
+        init_simulator(&group->lanes[i], arena);
+    }
+}
+
+inline LaneVector lane_load(u16* values) {
+    return _mm_load_si128((LaneVector*)values);
+}
+
+inline void lane_store(u16* values, LaneVector v) {
+    _mm_store_si128((LaneVector*)values, v);
+}
+
+inline LaneVector lane_set(u16 value) {
+    return _mm_set1_epi16((short)value);
+}
+
+// Unsigned a < b per lane, as an all-ones mask.
+inline LaneVector lane_below(LaneVector a, LaneVector b) {
+    LaneVector bias = lane_set(0x8000);
+    return _mm_cmplt_epi16(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias));
+}
+
+// Moves bit 15 of every lane to flag.
+inline LaneVector lane_sign_to(LaneVector v, int flag_shift) {
+    return _mm_slli_epi16(_mm_srli_epi16(v, 15), flag_shift);
+}
+
+// ZF, SF and PF of word results.
+inline LaneVector lane_result_flags(LaneVector result) {
+    LaneVector zf = _mm_and_si128(_mm_cmpeq_epi16(result, _mm_setzero_si128()), lane_set(FLAG_ZF));
+    LaneVector sf = lane_sign_to(result, 7);
+
+    LaneVector p = _mm_and_si128(result, lane_set(0xFF));
+    p = _mm_xor_si128(p, _mm_srli_epi16(p, 4));
+    p = _mm_xor_si128(p, _mm_srli_epi16(p, 2));
+    p = _mm_xor_si128(p, _mm_srli_epi16(p, 1));
+    LaneVector pf = _mm_slli_epi16(_mm_andnot_si128(p, lane_set(1)), 2);
+
+    return _mm_or_si128(zf, _mm_or_si128(sf, pf));
+}
+
+// alu() for a word register in every lane. Matches it flag for flag.
+void lane_alu(LaneGroup* group, u8 op, u8 destination, LaneVector b, bool write) {
+    LaneVector a = lane_load(group->registers[destination]);
+    LaneVector flags = lane_load(group->flags);
+    LaneVector carry = _mm_and_si128(flags, lane_set(FLAG_CF));
+    LaneVector carry_mask = _mm_cmpeq_epi16(carry, lane_set(1));
+
+    LaneVector result;
+    LaneVector cf = _mm_setzero_si128();
+    LaneVector of = _mm_setzero_si128();
+    LaneVector af = _mm_setzero_si128();
+
+    switch (op) {
+        case ALU_ADD:
+        case ALU_ADC: {
+            if (op == ALU_ADD) {
+                carry = _mm_setzero_si128();
+                carry_mask = carry;
+            }
+            result = _mm_add_epi16(_mm_add_epi16(a, b), carry);
+            cf = _mm_or_si128(lane_below(result, a), _mm_and_si128(_mm_cmpeq_epi16(result, a), carry_mask));
+            of = lane_sign_to(_mm_and_si128(_mm_xor_si128(a, result), _mm_xor_si128(b, result)), 11);
+        } break;
+
+        case ALU_SUB:
+        case ALU_CMP:
+        case ALU_SBB: {
+            if (op != ALU_SBB) {
+                carry = _mm_setzero_si128();
+                carry_mask = carry;
+            }
+            result = _mm_sub_epi16(_mm_sub_epi16(a, b), carry);
+            cf = _mm_or_si128(lane_below(a, b), _mm_and_si128(_mm_cmpeq_epi16(a, b), carry_mask));
+            of = lane_sign_to(_mm_and_si128(_mm_xor_si128(a, b), _mm_xor_si128(a, result)), 11);
+        } break;
+
+        case ALU_OR:  result = _mm_or_si128(a, b);  break;
+        case ALU_AND: result = _mm_and_si128(a, b); break;
+        default:      result = _mm_xor_si128(a, b); break;
+    }
+
+    if (op != ALU_OR && op != ALU_AND && op != ALU_XOR) {
+        cf = _mm_and_si128(cf, lane_set(FLAG_CF));
+        af = _mm_and_si128(_mm_xor_si128(_mm_xor_si128(a, b), result), lane_set(FLAG_AF));
+    }
+
+    LaneVector computed = _mm_or_si128(_mm_or_si128(cf, of), _mm_or_si128(af, lane_result_flags(result)));
+    lane_store(group->flags, _mm_or_si128(_mm_andnot_si128(lane_set(ARITHMETIC_FLAGS), flags), computed));
+
+    if (write) {
+        lane_store(group->registers[destination], result);
+    }
+}
+
+// inc and dec, which keep CF.
+void lane_step(LaneGroup* group, u8 reg, bool increment) {
+    LaneVector carry = _mm_and_si128(lane_load(group->flags), lane_set(FLAG_CF));
+    lane_alu(group, increment ? ALU_ADD : ALU_SUB, reg, lane_set(1), true);
+
+    LaneVector flags = _mm_andnot_si128(lane_set(FLAG_CF), lane_load(group->flags));
+    lane_store(group->flags, _mm_or_si128(flags, carry));
+}
+
+inline void lane_move(LaneGroup* group, u8 destination, LaneVector value) {
+    lane_store(group->registers[destination], value);
+}
+
+inline void lane_exchange(LaneGroup* group, u8 a, u8 b) {
+    LaneVector value = lane_load(group->registers[a]);
+    lane_store(group->registers[a], lane_load(group->registers[b]));
+    lane_store(group->registers[b], value);
+}
+
+// Runs word sized register-only instructions in every lane at once. Returns
+// false for anything else.
+bool execute_vector(LaneGroup* group, DecodedInstruction* instruction) {
+    u8 op = instruction->opcode;
+    u8 reg = instruction->reg;
+    u8 rm = instruction->rm;
+
+    // inc, dec and xchg ax on a register are always word sized; bit 0 of
+    // their opcode is part of the register, not a w bit.
+    bool always_word = instruction->op_class == OP_CLASS_REGISTER ||
+                       instruction->op_class == OP_CLASS_ACCUMULATOR_REGISTER;
+    if (!instruction->word && !always_word) {
+        return false;
+    }
+
+    switch (instruction->op_class) {
+        case OP_CLASS_REGISTER_MEMORY_AND_REGISTER: {
+            if (!instruction->rm_is_register) {
+                return false;
+            }
+
+            u8 destination = instruction->dir ? reg : rm;
+            u8 source = instruction->dir ? rm : reg;
+
+            if (op <= 0x3F) {
+                u8 alu_op = (op >> 3) & 0x07;
+                lane_alu(group, alu_op, destination, lane_load(group->registers[source]), alu_op != ALU_CMP);
+            } else if (op == 0x85) {                       // test
+                lane_alu(group, ALU_AND, rm, lane_load(group->registers[reg]), false);
+            } else if (op == 0x87) {                       // xchg
+                lane_exchange(group, reg, rm);
+            } else if (op == 0x89 || op == 0x8B) {         // mov
+                lane_move(group, destination, lane_load(group->registers[source]));
+            } else {
+                return false;
+            }
+        } return true;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY: {
+            if (!instruction->rm_is_register) {
+                return false;
+            }
+
+            LaneVector data = lane_set(instruction->data);
+            if (op == 0x81 || op == 0x83) {
+                lane_alu(group, reg, rm, data, reg != ALU_CMP);
+            } else if (op == 0xC7) {                       // mov
+                lane_move(group, rm, data);
+            } else if (op == 0xF7) {                       // test
+                lane_alu(group, ALU_AND, rm, data, false);
+            } else {
+                return false;
+            }
+        } return true;
+
+        case OP_CLASS_IMMEDIATE_TO_ACCUMULATOR: {
+            LaneVector data = lane_set(instruction->data);
+            if (op <= 0x3F) {
+                u8 alu_op = (op >> 3) & 0x07;
+                lane_alu(group, alu_op, REGISTER_AX, data, alu_op != ALU_CMP);
+            } else if (op == 0xA9) {                       // test
+                lane_alu(group, ALU_AND, REGISTER_AX, data, false);
+            } else {
+                return false;
+            }
+        } return true;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER: {
+            lane_move(group, reg, lane_set(instruction->data));
+        } return true;
+
+        case OP_CLASS_REGISTER: {
+            if (op >= 0x50) {                              // push, pop
+                return false;
+            }
+            lane_step(group, reg, op < 0x48);
+        } return true;
+
+        case OP_CLASS_ACCUMULATOR_REGISTER: {
+            lane_exchange(group, REGISTER_AX, reg);
+        } return true;
+
+        default: {
+        } return false;
+    }
+}
+
+inline void gather_lane(LaneGroup* group, int lane) {
+    Machine* m = &group->lanes[lane].machine;
+    for (int r = 0; r < 8; r++) {
+        group->registers[r][lane] = m->registers[r];
+    }
+    group->flags[lane] = m->flags;
+}
+
+inline void scatter_lane(LaneGroup* group, int lane) {
+    Machine* m = &group->lanes[lane].machine;
+    for (int r = 0; r < 8; r++) {
+        m->registers[r] = group->registers[r][lane];
+    }
+    m->flags = group->flags[lane];
+    m->ip = group->ip;
+}
+
+// Takes lanes out of lockstep. Their state must already be in their
+// Simulator. executed says whether they ran the current instruction.
+void leave_lockstep(LaneGroup* group, u32 lanes, bool executed, bool park, StopReason reason) {
+    for (u32 bits = lanes; bits; bits &= bits - 1) {
+        int lane = lowest_bit(bits);
+        group->lanes[lane].instruction_count += group->steps + (executed ? 1 : 0);
+        group->lane_stops[lane] = reason;
+    }
+
+    group->active &= ~lanes;
+    if (park) {
+        group->parked |= lanes;
+    }
+}
+
+// A conditional jump or loop: the leader's lanes follow it, the rest park
+// with ip on the other path.
+void branch_lanes(LaneGroup* group, DecodedInstruction* instruction, int leader) {
+    u8 op = instruction->opcode;
+
+    if (op >= 0xE0 && op <= 0xE2) {                        // loop family
+        u16* cx = group->registers[REGISTER_CX];
+        lane_store(cx, _mm_sub_epi16(lane_load(cx), lane_set(1)));
+    }
+
+    u32 taken = 0;
+    for (u32 bits = group->active; bits; bits &= bits - 1) {
+        int lane = lowest_bit(bits);
+        u16 flags = group->flags[lane];
+        u16 cx = group->registers[REGISTER_CX][lane];
+
+        bool lane_taken;
+        if (op < 0x80) {
+            lane_taken = condition(flags, op & 0x0F);
+        } else if (op == 0xE3) {                           // jcxz
+            lane_taken = cx == 0;
+        } else {
+            lane_taken = cx != 0;
+            if (op == 0xE0) lane_taken = lane_taken && !(flags & FLAG_ZF);
+            if (op == 0xE1) lane_taken = lane_taken && (flags & FLAG_ZF);
+        }
+
+        if (lane_taken) {
+            taken |= 1u << lane;
+        }
+    }
+
+    u16 next = (u16)(instruction->address + instruction->length);
+    u16 target = (u16)instruction->target;
+
+    bool leader_taken = (taken >> leader) & 1;
+    u32 others = leader_taken ? (group->active & ~taken) : (group->active & taken);
+
+    group->ip = leader_taken ? next : target;
+    for (u32 bits = others; bits; bits &= bits - 1) {
+        scatter_lane(group, lowest_bit(bits));
+    }
+    leave_lockstep(group, others, true, true, STOP_NONE);
+
+    group->ip = leader_taken ? target : next;
+}
+
+// Runs one instruction through execute() in each active lane, then parks
+// any lane that ends up somewhere other than the leader.
+void execute_scalar(LaneGroup* group, DecodedInstruction* instruction, u32 address, int leader) {
+    u16 ip = group->ip;
+
+    for (u32 bits = group->active; bits; bits &= bits - 1) {
+        int lane = lowest_bit(bits);
+        Simulator* sim = &group->lanes[lane];
+
+        scatter_lane(group, lane);
+        sim->machine.ip = ip + instruction->length;
+
+        StopReason reason = execute<BareHooks>(sim, instruction, address);
+        if (reason == STOP_UNSUPPORTED_INSTRUCTION) {
+            sim->machine.ip = ip;
+            sim->stop_address = address;
+            leave_lockstep(group, 1u << lane, false, false, reason);
+        } else if (reason != STOP_NONE) {
+            sim->stop_address = address;
+            leave_lockstep(group, 1u << lane, true, false, reason);
+        } else {
+            gather_lane(group, lane);
+        }
+    }
+
+    if (!group->active) {
+        return;
+    }
+
+    leader = lowest_bit(group->active);
+    Machine* lead = &group->lanes[leader].machine;
+    group->ip = lead->ip;
+
+    u32 others = 0;
+    for (u32 bits = group->active; bits; bits &= bits - 1) {
+        int lane = lowest_bit(bits);
+        Machine* m = &group->lanes[lane].machine;
+        if (m->ip != lead->ip || m->segment_registers[SEGMENT_CS] != lead->segment_registers[SEGMENT_CS]) {
+            others |= 1u << lane;
+        }
+    }
+    leave_lockstep(group, others, true, true, STOP_NONE);
+}
+
+// Runs every lane from its Simulator's current state until each one stops
+// or has run max_instructions. Per-lane results are in lane_stops and each
+// lane's Simulator.
+void run_lanes(LaneGroup* group, u64 max_instructions = ~0ull) {
+    group->active = 0;
+    group->parked = 0;
+    group->steps = 0;
+
+    Machine* first = &group->lanes[0].machine;
+    group->ip = first->ip;
+
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        Machine* m = &group->lanes[lane].machine;
+        group->lane_stops[lane] = STOP_NONE;
+        if (m->ip == first->ip && m->segment_registers[SEGMENT_CS] == first->segment_registers[SEGMENT_CS]) {
+            gather_lane(group, lane);
+            group->active |= 1u << lane;
+        } else {
+            group->parked |= 1u << lane;
+        }
+    }
+
+    while (group->active) {
+        int leader = lowest_bit(group->active);
+        Simulator* lead = &group->lanes[leader];
+
+        u32 address = physical_address(&lead->machine, SEGMENT_CS, group->ip);
+        StopReason stop_reason = STOP_NONE;
+        if (address >= lead->code_end) {
+            stop_reason = STOP_END_OF_CODE;
+        } else if (group->steps >= max_instructions) {
+            stop_reason = STOP_INSTRUCTION_LIMIT;
+        }
+
+        DecodedInstruction instruction;
+        if (stop_reason == STOP_NONE &&
+            !decode_one(&lead->decoder, &lead->machine.memory[address], MEMORY_SIZE - address, group->ip, &instruction)) {
+            stop_reason = STOP_INVALID_INSTRUCTION;
+        }
+
+        if (stop_reason != STOP_NONE) {
+            for (u32 bits = group->active; bits; bits &= bits - 1) {
+                int lane = lowest_bit(bits);
+                scatter_lane(group, lane);
+                group->lanes[lane].stop_address = address;
+            }
+            leave_lockstep(group, group->active, false, false, stop_reason);
+            break;
+        }
+
+        if (execute_vector(group, &instruction)) {
+            group->ip += instruction.length;
+            group->vector_steps += 1;
+        } else if (instruction.op_class == OP_CLASS_JUMP) {
+            branch_lanes(group, &instruction, leader);
+            group->vector_steps += 1;
+        } else {
+            execute_scalar(group, &instruction, address, leader);
+            group->scalar_steps += 1;
+        }
+
+        group->steps += 1;
+    }
+
+    for (u32 bits = group->parked; bits; bits &= bits - 1) {
+        int lane = lowest_bit(bits);
+        Simulator* sim = &group->lanes[lane];
+        u64 budget = (sim->instruction_count < max_instructions) ? max_instructions - sim->instruction_count : 0;
+        group->lane_stops[lane] = run(sim, budget);
+    }
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+// Length-only pre-decode.
+//
+// instruction_length() works out how many bytes decode_one() consumes for
+// an instruction without building operands or text: one table lookup for
+// the opcode and, when there is a mod/rm byte, one check of the mode for
+// the displacement. Opcodes the full decoder rejects have length 0.
+//
+// BoundaryIndex records where every instruction starts as one bit per byte,
+// plus the address of every BOUNDARY_CHECKPOINT_INTERVAL'th instruction so
+// seeking to the Nth instruction only counts bits from the nearest
+// checkpoint.
+
+#include "decoder.h"
+
+// Low nibble is the length without displacement or group 3 immediate.
+#define LM 0x10  // has a mod/rm byte, add its displacement
+#define LG 0x20  // group 3 (F6/F7), immediate only when reg == 0 (test)
+#define LL 0x40  // lock prefix
+#define LS 0x80  // segment override prefix
+
+const u8 length_table[256] = {
+    /* 0_ */ 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 3     , 1     , 1     , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 3     , 1     , 1,
+    /* 1_ */ 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 3     , 1     , 1     , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 3     , 1     , 1,
+    /* 2_ */ 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 3     , LS    , 1     , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 3     , LS    , 1,
+    /* 3_ */ 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 3     , LS    , 1     , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 3     , LS    , 1,
+    /* 4_ */ 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1,
+    /* 5_ */ 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1,
+    /* 6_ */ 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0,
+    /* 7_ */ 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2,
+    /* 8_ */ 3|LM  , 4|LM  , 3|LM  , 3|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2|LM,
+    /* 9_ */ 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 1     , 5     , 1     , 1     , 1     , 1     , 1,
+    /* A_ */ 3     , 3     , 3     , 3     , 1     , 1     , 1     , 1     , 2     , 3     , 0     , 0     , 1     , 1     , 1     , 1,
+    /* B_ */ 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 3     , 3     , 3     , 3     , 3     , 3     , 3     , 3,
+    /* C_ */ 0     , 0     , 3     , 1     , 2|LM  , 2|LM  , 3|LM  , 4|LM  , 0     , 0     , 3     , 1     , 1     , 2     , 1     , 1,
+    /* D_ */ 2|LM  , 2|LM  , 2|LM  , 2|LM  , 2     , 2     , 1     , 1     , 0     , 0     , 0     , 0     , 0     , 0     , 0     , 0,
+    /* E_ */ 2     , 2     , 2     , 2     , 2     , 2     , 2     , 2     , 3     , 3     , 5     , 2     , 1     , 1     , 1     , 1,
+    /* F_ */ LL    , 0     , 0     , 2     , 1     , 1     , 2|LM|LG, 2|LM|LG, 1   , 1     , 1     , 1     , 1     , 1     , 2|LM  , 2|LM,
+};
+
+#undef LM
+#undef LG
+#undef LL
+#undef LS
+
+#define LENGTH_MODRM   0x10
+#define LENGTH_GROUP3  0x20
+#define LENGTH_LOCK    0x40
+#define LENGTH_SEGMENT 0x80
+
+inline int modrm_displacement_length(u8 modrm) {
+    u8 mode = modrm >> 6;
+    if (mode == MODE_MEMORY_8_BIT_DISPLACEMENT)  return 1;
+    if (mode == MODE_MEMORY_16_BIT_DISPLACEMENT) return 2;
+    if ((modrm & 0xC7) == 0x06)                  return 2;
+    return 0;
+}
+
+// Returns the instruction length in bytes, or 0 if the full decoder cannot
+// decode it.
+inline int instruction_length(u8* bytes) {
+    int length = 0;
+    u8 shape = length_table[bytes[0]];
+
+    if (shape & LENGTH_LOCK) {
+        bytes += 1;
+        length += 1;
+        shape = length_table[bytes[0]];
+    }
+
+    if (shape & LENGTH_SEGMENT) {
+        bytes += 1;
+        length += 1;
+        shape = length_table[bytes[0]];
+    }
+
+    // Only a single lock followed by a single segment override is accepted.
+    if (shape & (LENGTH_LOCK | LENGTH_SEGMENT)) {
+        return 0;
+    }
+
+    u8 base = shape & 0x0F;
+    if (base == 0) {
+        return 0;
+    }
+
+    length += base;
+    if (shape & LENGTH_MODRM) {
+        length += modrm_displacement_length(bytes[1]);
+
+        if ((shape & LENGTH_GROUP3) && (bytes[1] & 0x38) == 0) {
+            length += 1 + (bytes[0] & 0x01);
+        }
+    }
+
+    return length;
+}
+
+#define BOUNDARY_CHECKPOINT_INTERVAL 64
+
+struct BoundaryIndex {
+    int size;
+    int count;
+
+    u64* bits;           // bit a is set when an instruction starts at address a
+    int* checkpoints;    // address of instruction k * BOUNDARY_CHECKPOINT_INTERVAL
+
+    int invalid_address; // first address that could not be decoded, or -1
+};
+
+void build_boundary_index(BoundaryIndex* index, u8* bytes, int size, MemoryArena* arena) {
+    int words = size / 64 + 1;
+    int max_checkpoints = size / BOUNDARY_CHECKPOINT_INTERVAL + 1;
+
+    index->size = size;
+    index->count = 0;
+    index->bits = (u64*)arena_alloc(arena, words * sizeof(u64));
+    index->checkpoints = (int*)arena_alloc(arena, max_checkpoints * sizeof(int));
+    index->invalid_address = -1;
+    memset(index->bits, 0, words * sizeof(u64));
+
+    int count = 0;
+    int address = 0;
+    while (address < size) {
+        int length = instruction_length(&bytes[address]);
+        if (length == 0) {
+            index->invalid_address = address;
+            break;
+        }
+
+        if ((count & (BOUNDARY_CHECKPOINT_INTERVAL - 1)) == 0) {
+            index->checkpoints[count / BOUNDARY_CHECKPOINT_INTERVAL] = address;
+        }
+
+        index->bits[address >> 6] |= 1ull << (address & 63);
+        count += 1;
+        address += length;
+    }
+
+    index->count = count;
+}
+
+inline bool is_boundary(BoundaryIndex* index, int address) {
+    if (address < 0 || address >= index->size) {
+        return false;
+    }
+    return (index->bits[address >> 6] >> (address & 63)) & 1;
+}
+
+// Address of the nth instruction, or -1 if there are not that many.
+int boundary_seek(BoundaryIndex* index, int n) {
+    if (n < 0 || n >= index->count) {
+        return -1;
+    }
+
+    int address = index->checkpoints[n / BOUNDARY_CHECKPOINT_INTERVAL];
+    int remaining = n % BOUNDARY_CHECKPOINT_INTERVAL;
+
+    int word = address >> 6;
+    u64 bits = index->bits[word] & (~0ull << (address & 63));
+    for (;;) {
+        int set = count_bits(bits);
+        if (remaining < set) {
+            break;
+        }
+        remaining -= set;
+        word += 1;
+        bits = index->bits[word];
+    }
+
+    while (remaining > 0) {
+        bits &= bits - 1;
+        remaining -= 1;
+    }
+
+    return word * 64 + lowest_bit(bits);
+}
+
+// Start address of the instruction covering address, or -1 if address is
+// outside the decoded range.
+int boundary_find(BoundaryIndex* index, int address) {
+    if (address < 0 || address >= index->size) {
+        return -1;
+    }
+
+    int word = address >> 6;
+    int shift = 63 - (address & 63);
+    u64 bits = (index->bits[word] << shift) >> shift;
+    while (bits == 0) {
+        if (word == 0) {
+            return -1;
+        }
+        word -= 1;
+        bits = index->bits[word];
+    }
+
+    return word * 64 + highest_bit(bits);
+}
@@ -1,845 +1,398 @@
-// TODO(roger): 8086 uses 1 mb for memory. Load file into this range. 
-//      MEMORY_ACCESS_MASK can be used to prevent reading out of bounds.
-
-#include "utility.h"
-
-#define MODE_MEMORY_NO_DISPLACEMENT     0
-#define MODE_MEMORY_8_BIT_DISPLACEMENT  1
-#define MODE_MEMORY_16_BIT_DISPLACEMENT 2
-#define MODE_REGISTER                   3
-
-const char* register_map_byte[8] = { 
-    "al", 
-    "cl", 
-    "dl", 
-    "bl", 
-    "ah", 
-    "ch", 
-    "dh", 
-    "bh" 
-};
-
-const char* register_map_word[8] = {
-    "ax",
-    "cx",
-    "dx",
-    "bx",
-    "sp",
-    "bp",
-    "si",
-    "di"
-};
-
-const char* effective_address_table[8] = {
-    "bx + si",
-    "bx + di",
-    "bp + si",
-    "bp + di",
-    "si",
-    "di",
-    "bp",
-    "bx"
-};
-
-const char* segments[] = { "es", "cs", "ss", "ds" };
-
-const char* group_one_mnemonics[] = {
-    "add", 
-    "or",
-    "adc",
-    "sbb",
-    "and",
-    "sub",
-    "xor",
-    "cmp"
-};
-
-enum OpClass {
-    OP_CLASS_NONE                         = 0,
-    OP_CLASS_REGISTER_MEMORY              = 1,
-    OP_CLASS_REGISTER_MEMORY_AND_REGISTER = 2,
-    OP_CLASS_IMMEDIATE                    = 3,
-    OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY = 4,
-    OP_CLASS_IMMEDIATE_TO_ACCUMULATOR     = 5,
-    OP_CLASS_SEG_REG                      = 6,
-};
-
-struct Instruction {
-    int address;
-    char* string;
-    
-    bool is_jump;
-    int jump_address;
-};
-
-char instruction_buffer[64];
-int instruction_count;
-Instruction instructions[4096];
+#include "decoder.h"
+#include "cycle_analysis.h"
+#include "debugger.h"
+#include "emit.h"
+#include "format.h"
+#include "instruction_store.h"
+#include "lanes.h"
+#include "length_decoder.h"
+#include "micro_ops.h"
+#include "pipeline.h"
+#include "sinks.h"
+#include "stats.h"
+
+InstructionStore instructions;
+
+// Fixed part of the arena: simulator memory, lane groups and the like.
+#define MAIN_ARENA_SIZE (32*1024*1024)
+
+// Everything kept per instruction or per jump, loop analysis included, comes
+// to less than this per input byte even when every byte starts one.
+#define MAIN_ARENA_BYTES_PER_INPUT_BYTE 32
+
+
+template <typename Sink>
+void decode_file(DecodeContext* decoder, MemoryBuffer* file, Sink* sink) {
+    if (!decode(decoder, file->buffer, (int)file->size, sink)) {
+        fputs("Unable to decode byte: ", stderr);
+        print_byte(decoder->error_byte, stderr);
+        fputc('\n', stderr);
+        ERROR_ABORT();
+    }
+}
 
-const char* instruction_prefix = 0;
+// Prints the instruction starting at address, as a listing line prefixed
+// with its address.
+bool print_instruction_at(MemoryBuffer* file, int address) {
+    DecodeContext ctx;
+    init_decode_context(&ctx);
 
+    DecodedInstruction instruction;
+    if (address < 0 || !decode_one(&ctx, &file->buffer[address], (int)file->size - address, address, &instruction)) {
+        return false;
+    }
 
-// CPU
-u16 registers[8]; 
+    char text[MAX_INSTRUCTION_TEXT];
+    render_instruction(&instruction, text);
+    printf("%5d  ", address);
+    fputs(text, stdout);
+    return true;
+}
 
+void trace_instruction(void*, Simulator*, DecodedInstruction* instruction) {
+    char text[MAX_INSTRUCTION_TEXT];
+    render_instruction(instruction, text);
+    printf("%5d  ", instruction->address);
+    fputs(text, stdout);
+}
 
-Instruction* capture_instruction(int address, const char* fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsprintf(instruction_buffer, fmt, ap);
-    va_end(ap);
+int main(int argc, char* argv[]) {
+    const char* filename = 0;
+    StatsFormat stats_format = STATS_FORMAT_NONE;
+    int report_loops = 0;
+    bool execute_program = false;
+    bool trace = false;
+    bool use_micro_ops = false;
+    bool pipelined = false;
+    int lane_count = 0;
+    SinkKind sink_kind = SINK_TEXT;
+    int breakpoint_count = 0;
+    int watchpoint_count = 0;
+    u32 breakpoints[16];
+    u32 watchpoints[16];
+    int find_count = 0;
+    int seek_count = 0;
+    int finds[16];
+    int seeks[16];
     
-    char* captured = (char*)&main_arena.buffer[main_arena.index];
-
-    if (instruction_prefix) {
-        const char* current = instruction_prefix; 
-        while (current[0] != 0) {
-            main_arena.buffer[main_arena.index++] = current[0];
-            current += 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--loops") == 0) {
+            report_loops = 10;
+        } else if (strncmp(argv[i], "--loops=", 8) == 0) {
+            report_loops = atoi(argv[i] + 8);
+        } else if (strcmp(argv[i], "--exec") == 0) {
+            execute_program = true;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            execute_program = true;
+            trace = true;
+        } else if (strcmp(argv[i], "--uops") == 0) {
+            execute_program = true;
+            use_micro_ops = true;
+        } else if (strcmp(argv[i], "--sink=text") == 0) {
+            sink_kind = SINK_TEXT;
+        } else if (strcmp(argv[i], "--sink=null") == 0) {
+            sink_kind = SINK_NULL;
+        } else if (strcmp(argv[i], "--sink=binary") == 0) {
+            sink_kind = SINK_BINARY;
+        } else if (strcmp(argv[i], "--sink=count") == 0) {
+            sink_kind = SINK_COUNTS;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipelined = true;
+        } else if (strncmp(argv[i], "--lanes=", 8) == 0) {
+            lane_count = atoi(argv[i] + 8);
+            if (lane_count < 1 || lane_count > LANE_COUNT) {
+                log_error("--lanes takes 1 to %d lanes.", LANE_COUNT);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--break=", 8) == 0 && breakpoint_count < 16) {
+            execute_program = true;
+            breakpoints[breakpoint_count++] = (u32)strtoul(argv[i] + 8, 0, 0);
+        } else if (strncmp(argv[i], "--watch=", 8) == 0 && watchpoint_count < 16) {
+            execute_program = true;
+            watchpoints[watchpoint_count++] = (u32)strtoul(argv[i] + 8, 0, 0);
+        } else if (strncmp(argv[i], "--find=", 7) == 0 && find_count < 16) {
+            finds[find_count++] = (int)strtol(argv[i] + 7, 0, 0);
+        } else if (strncmp(argv[i], "--seek=", 7) == 0 && seek_count < 16) {
+            seeks[seek_count++] = (int)strtol(argv[i] + 7, 0, 0);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats_format = STATS_FORMAT_TEXT;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats_format = STATS_FORMAT_JSON;
+        } else {
+            filename = argv[i];
         }
     }
 
-    const char* current = instruction_buffer; 
-    while (current[0] != 0) {
-        main_arena.buffer[main_arena.index++] = current[0];
-        current += 1;
+    // The other sinks replace the listing, which everything else builds on.
+    if (sink_kind != SINK_TEXT &&
+        (stats_format != STATS_FORMAT_NONE || report_loops > 0 || pipelined || execute_program ||
+         lane_count > 0 || find_count > 0 || seek_count > 0)) {
+        log_error("--sink=null, binary and count only decode; they can't be combined with other options.");
+        return 1;
     }
-    
-    main_arena.buffer[main_arena.index++] = '\0';
-
-    Instruction* instruction = &instructions[instruction_count];
-    instruction_count += 1;
-
-    instruction->address = address;
-    instruction->string = captured;
-    
-    instruction_prefix = 0;
-    return instruction;
-}
 
-Instruction* capture_jump_instruction(int address, int jump_address, const char* mnemonic) {
-    Instruction* instruction = capture_instruction(address, mnemonic);
-    instruction->is_jump = true;
-    instruction->jump_address = jump_address;
-    return instruction;
-}
+    if (stats_format != STATS_FORMAT_NONE && !STATS_AVAILABLE) {
+        log_error("--stats requires a build with ENABLE_STATS (build.bat Stats).");
+        return 1;
+    }
 
-int extract_encoded_data(u8* bytes, int current_byte, bool extract_word, bool use_signed_immediate, u16* data) {
-    if (extract_word) {
-        if (use_signed_immediate) {
-            u8 sign = bytes[current_byte] & 0x80;
-            if (sign) {
-                *data = 0xFF00;
-            }
-            *data |= bytes[current_byte];
-            return 1; 
-        }
+    // Stats are only collected for the listing.
+    if (stats_format != STATS_FORMAT_NONE &&
+        (report_loops > 0 || pipelined || execute_program || lane_count > 0 || find_count > 0 || seek_count > 0)) {
+        log_error("--stats only covers the listing; it can't be combined with --loops, --pipeline, --exec, --lanes, --find or --seek.");
+        return 1;
+    }
 
-        *data = bytes[current_byte] | (bytes[current_byte + 1] << 8);
-        return 2; 
+    // Micro-ops only replace the bare loop; hooks need run().
+    if (use_micro_ops && (trace || breakpoint_count > 0 || watchpoint_count > 0)) {
+        log_error("--uops can't be combined with --trace, --break or --watch.");
+        return 1;
     }
- 
-    *data = bytes[current_byte];
-    return 1;
-}
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <filename>\n", argv[0]);
+    if (filename == 0) {
+        printf("Usage: %s [--stats|--stats=json] [--loops[=count]] [--sink=text|null|binary|count] [--pipeline] [--exec|--trace|--uops|--lanes=count] [--break=address] [--watch=address] [--find=address] [--seek=index] <filename>\n", argv[0]);
         return 1;
     }
 
-    init_arena(&main_arena, 32*1024*1024);
+    // Streams the listing; the whole file is never held in memory.
+    if (pipelined && !execute_program && report_loops == 0) {
+        init_arena(&main_arena, MAIN_ARENA_SIZE);
+        DecodeContext decoder;
+        if (!run_pipeline(filename, stdout, &main_arena, &decoder)) {
+            if (decoder.error_address < 0) {
+                return 1;
+            }
+            fputs("Unable to decode byte: ", stderr);
+            print_byte(decoder.error_byte, stderr);
+            fputc('\n', stderr);
+            ERROR_ABORT();
+        }
+        return 0;
+    }
     
+    STATS_BEGIN_PHASE(STATS_PHASE_READ);
     MemoryBuffer file = {};
-    if (!read_entire_file(&file, argv[1], main_arena_alloc)) {
+    if (!read_entire_file(&file, filename, malloc)) {
         return 1;
     }
+    if (file.size > 0x7FFFFFFF) {
+        log_error("%s is %llu bytes; listings address at most 2 GB.", filename, (unsigned long long)file.size);
+        return 1;
+    }
+    STATS_END_PHASE(STATS_PHASE_READ);
     
-    for (int i = 0; i < file.size;) {
-        int address = i;
-        u8* bytes = &file.buffer[i];
-        
-        bool use_segment_override = false;
-        u8 segment_override = 0;
-        
-        bool is_bit_shift = false;
-        u8 bit_shift_type = 0;
-
-        bool use_signed_immediate = false;
-        bool decode_register_memory = false;
-        bool extract_data = false;
-        bool extract_word = false;
-        bool use_lock = false;
-        
-        OpClass op_class = OP_CLASS_NONE;
-        const char* op_text = 0;
-        
-        if (bytes[0] == 0xF0) {
-            instruction_prefix = "lock ";
-            use_lock = true;
-            i += 1;
-            bytes = &file.buffer[i];
-        }
-        
-        switch (bytes[0]) {
-            case 0x26:
-            case 0x2E:
-            case 0x36:
-            case 0x3E: {
-                use_segment_override = true;
-                segment_override = bytes[0] >> 3 & 0x03;
-                i += 1;
-                bytes = &file.buffer[i];
-            } break;
-        }
-        
-        int byte_count = 0;
-        
-        u8 word = bytes[0] & 0x01;
-        u8 mode = bytes[1] >> 6;
-        u8 rm   = bytes[1] & 0x07;
-        u8 dir  = bytes[0] & 0x02;
-        
-        if (bytes[0] >= 0x00 && bytes[0] <= 0x3F) {
-            if ((bytes[0] & 0x06) == 0x06) {
-                if ((bytes[0] & 0xF0) <= 0x10) {
-                    op_text = (bytes[0] & 0x01) ? "pop" : "push";
-                    
-                    capture_instruction(address, "%s %s\n", op_text, segments[(bytes[0] >> 3) & 0x03]);
-                    i += 1;
-                    continue;
-                    
-                } else if (bytes[0] & 0x07 == 0x07) {
-                    switch ((bytes[0] >> 3) & 0x03) {
-                        case 0: op_text = "daa"; break;
-                        case 1: op_text = "das"; break;
-                        case 2: op_text = "aaa"; break;
-                        case 3: op_text = "aas"; break;
-                    }
-                
-                    capture_instruction(address, "%s\n", op_text);
-                    i += 1;
-                    continue;
-
-                }
-                
-            } else { 
-                op_text = group_one_mnemonics[((bytes[0] >> 3) & 0x07)];
-
-                if (bytes[0] & 0x04) {
-                    op_class = OP_CLASS_IMMEDIATE_TO_ACCUMULATOR;
-                    extract_data = true;
-                    extract_word = word != 0;
-                    byte_count += 1;
-                } else {
-                    op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
-                    decode_register_memory = true;
-                    byte_count += 2;
-                }
-            }
-            
-        } else if (bytes[0] >= 0x40 && bytes[0] <= 0x5F) {
-            const char* reg = register_map_word[bytes[0] & 0x07];
-            
-            const char* mnemonics[] = {
-                "inc",
-                "dec",
-                "push",
-                "pop",
-            };
-            
-            op_text = mnemonics[(bytes[0] >> 3) & 0x03];
-            capture_instruction(address, "%s %s\n", op_text, reg);
-            
-            i += 1;
-            continue;
-            
-        } else if ((bytes[0] & 0xF0) == 0x70) {
-            const char* mnemonics[] = {
-                "jo",
-                "jno",
-                "jb",
-                "jnb",
-                "je",
-                "jne",
-                "jbe",
-                "jnbe",
-                "js",
-                "jns",
-                "jp",
-                "jnp",
-                "jl",
-                "jnl",
-                "jle",
-                "jnle"
-            };
-            
-            op_text = mnemonics[bytes[0] & 0x0F];
-            
-            i += 2; // move forward before capturing target address.
-            capture_jump_instruction(address, i + (char)bytes[1], op_text);
-            continue;
-        
-        } else if (bytes[0] >= 0x80 && bytes[0] <= 0x82) {
-            op_class = OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY;
-            decode_register_memory = true;
-            extract_data = true;
-            extract_word = word != 0;
-            op_text = group_one_mnemonics[((bytes[1] >> 3) & 0x07)];
-            use_signed_immediate = (bytes[0] & 0b00000010) != 0;
-            
-            byte_count += 2;
-            
-        } else if (bytes[0] == 0x83) {
-            op_class = OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY;
-            decode_register_memory = true;
-            extract_data = true;
-            extract_word = word != 0;
-            op_text = group_one_mnemonics[((bytes[1] >> 3) & 0x07)];
-            use_signed_immediate = true;
-            
-            byte_count += 2;
-            
-        } else if (bytes[0] >= 0x84 && bytes[0] <= 0x87) {
-            const char* mnemonics[] = {
-                "test",
-                "test",
-                "xchg",
-                "xchg"
-            };
-            
-            op_text = mnemonics[(bytes[0] & 0x0F) - 0x04];
-            op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
-            decode_register_memory = true;
-            
-            if (use_lock) {
-                dir = 0;
-            } else {
-                dir = bytes[0] & 0x02;
-            }
-            
-            byte_count += 2;
-        
-        } else if (bytes[0] >= 0x88 && bytes[0] <= 0x8B) {
-            op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
-            decode_register_memory = true;
-            op_text = "mov";
-            byte_count += 2;
-            
-        } else if (bytes[0] == 0x8C || bytes[0] == 0x8E) {
-            op_class = OP_CLASS_SEG_REG;
-            decode_register_memory = true;
-            op_text = "mov";
-            byte_count += 2;
-        
-        } else if (bytes[0] == 0x8D) {
-            op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
-            decode_register_memory = true;
-            op_text = "lea";
-            dir = 1;
-            byte_count += 2;
-        
-        } else if (bytes[0] == 0x8F) {
-            op_class = OP_CLASS_REGISTER_MEMORY;
-            decode_register_memory = true;
-            op_text = "pop";
-            byte_count += 2;
-            
-        } else if (bytes[0] >= 0x90 && bytes[0] <= 0x97) {
-            capture_instruction(address, "xchg ax, %s\n", register_map_word[bytes[0] & 0x0F]);
-            i += 1;
-            continue;
-            
-        } else if ((bytes[0] & 0xFE) == 0x98) { 
-            capture_instruction(address, "%s\n", (bytes[0] & 0x01) ? "cwd" : "cbw");
-            i += 1;
-            continue;
-        
-        } else if (bytes[0] == 0x9A) {
-            u16 displacement = bytes[1] | (bytes[2] << 8);
-            u16 seg = bytes[3] | (bytes[4] << 8);
-
-            capture_instruction(address, "call %lu:%lu\n", seg, displacement);
-            i += 5;
-            continue;
-        
-        } else if (bytes[0] == 0x9B) { 
-            capture_instruction(address, "wait\n");
-            i += 1;
-            continue;
-        
-        } else if ((bytes[0] & 0xFC) == 0x9C) {
-            const char* mnemonics[] = {
-                "pushf",
-                "popf",
-                "sahf",
-                "lahf",
-            };
-            
-            capture_instruction(address, "%s\n", mnemonics[bytes[0] & 0x03]);
-            i += 1;
-            continue;
-        
-        } else if ((bytes[0] & 0xFC) == 0xA0) {
-            u16 address = bytes[1] | bytes[2] << 8;
-            if (dir) {
-                capture_instruction(address, "mov [%hd], %s\n", address, word ? "ax" : "al");
-            } else {
-                capture_instruction(address, "mov %s, [%hd]\n", word ? "ax" : "al", address);
-            }
-            i += 3;
-            continue;
-            
-        } else if ((bytes[0] & 0xFE) == 0xA8) {
-            extract_data = true;
-            extract_word = word != 0;
-            op_class = OP_CLASS_IMMEDIATE_TO_ACCUMULATOR;
-            op_text = "test";
-            byte_count += 1;
-        
-        } else if ((bytes[0] & 0xFC) == 0xA4 || (bytes[0] & 0xFC) == 0xAC) {
-            if (bytes[0] & 0x08) {
-                op_text = (bytes[0] & 0x02) ? "lods" : "scas";
-            } else {
-                op_text = (bytes[0] & 0x02) ? "movs" : "cmps";
-            }
-            
-            word = bytes[0] & 0x01;
-            capture_instruction(address, "%s%s\n", op_text, word ? "w" : "b");
-            
-            i += 1;
-            continue;
-            
-        } else if ((bytes[0] & 0xF0) == 0xB0) {
-            u16 data = 0;
-            u8 reg = bytes[0] & 0x07;
-            bool use_word = (bytes[0] & 0x08) != 0;
-        
-            byte_count += 1;
-            byte_count += extract_encoded_data(bytes, byte_count, use_word, false, &data);
-            
-            const char** reg_table = use_word ? register_map_word : register_map_byte; 
-            const char* reg_label = reg_table[reg];
-            const char* size_label = use_word ? "word" : "byte";
-            capture_instruction(address, "mov %s, %s %hu\n", reg_label, size_label, data);
-        
-            i += byte_count;    
-            continue;
-        
-        } else if ((bytes[0] & 0xFE) == 0xC2) {
-            u8 no_immediate = bytes[0] & 0x01;
-            if (no_immediate) {
-                capture_instruction(address, "ret\n");
-                i += 1;
-                continue;
-                
-            } else {
-                extract_data = true;
-                extract_word = true;
-                byte_count += 1;
-                op_text = "ret";
-                op_class = OP_CLASS_IMMEDIATE;
+    init_arena(&main_arena, MAIN_ARENA_SIZE + file.size * MAIN_ARENA_BYTES_PER_INPUT_BYTE);
+    if (main_arena.buffer == 0) {
+        log_error("Failed to allocate memory for %s", filename);
+        return 1;
+    }
+    init_instruction_store(&instructions, &main_arena);
+    
+    // Random access: --find names the instruction covering a byte, --seek
+    // the nth instruction. Only lengths are decoded to get there.
+    if (find_count > 0 || seek_count > 0) {
+        BoundaryIndex boundaries;
+        build_boundary_index(&boundaries, file.buffer, (int)file.size, &main_arena);
+        
+        bool found_all = true;
+        for (int i = 0; i < find_count; i++) {
+            bool decoded = boundaries.invalid_address < 0 || finds[i] < boundaries.invalid_address;
+            if (!decoded || !print_instruction_at(&file, boundary_find(&boundaries, finds[i]))) {
+                log_error("No instruction covers byte %d.", finds[i]);
+                found_all = false;
             }
-        
-        } else if ((bytes[0] & 0xFE) == 0xC4) {
-            op_class = OP_CLASS_REGISTER_MEMORY_AND_REGISTER;
-            decode_register_memory = true;
-            op_text = (bytes[0] & 0x01) ? "lds" : "les";
-            word = 1;
-            dir = 1;
-            byte_count += 2;
-        
-        } else if ((bytes[0] & 0xFE) == 0xC6) {
-            op_class = OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY;
-            decode_register_memory = true;
-            extract_data = true;
-            extract_word = word != 0;
-            op_text = "mov";
-            byte_count += 2;
-            
-        } else if ((bytes[0] & 0xFE) == 0xCA) {
-            if (bytes[0] & 0x01) {
-                capture_instruction(address, "retf\n");
-                i += 1;
-                continue;
-            } else {
-                extract_data = true;
-                extract_word = true;
-                byte_count += 1;
-                op_text = "retf";
-                op_class = OP_CLASS_IMMEDIATE;
+        }
+        for (int i = 0; i < seek_count; i++) {
+            if (!print_instruction_at(&file, boundary_seek(&boundaries, seeks[i]))) {
+                log_error("There is no instruction %d.", seeks[i]);
+                found_all = false;
             }
-            
-        } else if ((bytes[0] & 0xFC) == 0xCC) {
-            const char* mnemonics[] = {
-                "int3",
-                "int",
-                "into",
-                "iret"
-            };
+        }
+        return found_all ? 0 : 1;
+    }
+    
+    // Runs lane_count copies of the program in lockstep. Lane i starts with
+    // ax = i, which a program can use to pick its input.
+    if (lane_count > 0) {
+        if (execute_program) {
+            log_error("--lanes can't be combined with --exec, --trace, --uops, --break or --watch.");
+            return 1;
+        }
         
-            u8 op = bytes[0] & 0x03;
-            op_text = mnemonics[op];
-            
-            if (op == 1) {
-                extract_data = true;
-                extract_word = false;
-                op_class = OP_CLASS_IMMEDIATE;
-                byte_count += 1;
-            } else {
-                capture_instruction(address, "%s\n", op_text);
-                i += 1;
-                continue;
+        LaneGroup* group = (LaneGroup*)arena_alloc(&main_arena, sizeof(LaneGroup), alignof(LaneGroup));
+        init_lane_group(group, &main_arena);
+        for (int i = 0; i < LANE_COUNT; i++) {
+            if (!load_program(&group->lanes[i], file.buffer, file.size)) {
+                return 1;
             }
-        
-        } else if (bytes[0] >= 0xD0 && bytes[0] <= 0xD3) { 
-            const char* mnemonics[] = {
-                "rol",
-                "ror",
-                "rcl",
-                "rcr",
-                "shl", // "sal"
-                "shr",
-                "unused",
-                "sar"
-            };
+            group->lanes[i].machine.registers[REGISTER_AX] = (u16)i;
             
-            op_text = mnemonics[(bytes[1] >> 3) & 0x07];
-            op_class = OP_CLASS_REGISTER_MEMORY;
-            decode_register_memory = true;
-            is_bit_shift = true;
-            bit_shift_type = bytes[0] & 0x02;
-
-            byte_count += 2;
-        
-        } else if ((bytes[0] & 0xFC) == 0xD4) {
-            const char* mnemonics[] = {
-                "aam",
-                "aad",
-                "unused",
-                "xlat",
-            };
-        
-            u8 index = bytes[0] & 0x03;
-            capture_instruction(address, "%s\n", mnemonics[index]);
-            
-            if (index >= 2) {
-                i += 1;
-            } else {
-                i += 2;
+            // Unused lanes start at the end of the code and stop at once.
+            if (i >= lane_count) {
+                group->lanes[i].machine.ip = (u16)file.size;
             }
-            
-            continue;
-            
-        } else if ((bytes[0] & 0xFC) == 0xE0) {
-            const char* mnemonics[] = {
-                "loopnz",
-                "loopz",
-                "loop",
-                "jcxz",
-            };
-        
-            i += 2; 
-            capture_jump_instruction(address, i + (char)bytes[1], mnemonics[bytes[0] & 0x03]);
-            continue;
+        }
         
-        } else if (bytes[0] >= 0xE4 && bytes[0] <= 0xE7) {
-            op_text = (bytes[0] & 0x2) ? "out" : "in";
-            op_class = OP_CLASS_IMMEDIATE_TO_ACCUMULATOR;
-            
-            extract_data = true;
-            extract_word = false;
-            
-            word = bytes[0] & 0x01;
-            byte_count += 1;
-            
-        } else if ((bytes[0] & 0xFE) == 0xE8) {
-            op_text = (bytes[0] & 0x01) ? "jmp" : "call";
-            short disp = bytes[1] | (bytes[2] << 8);
-            short next_ip = address + 3 + disp;
-            
-            capture_instruction(address, "%s %ld\n", op_text, next_ip);
-            i += 3;
-            continue;
-            
-        } else if (bytes[0] == 0xEA) {
-            u16 ip = bytes[1] | (bytes[2] << 8);
-            u16 cs = bytes[3] | (bytes[4] << 8);
-
-            capture_instruction(address, "jmp %lu:%lu\n", cs, ip);
-            i += 5;
-            continue;
-            
-        } else if (bytes[0] == 0xEB) {
-            capture_instruction(address, "jmp %lld\n", (char)bytes[1]);
-            i += 2;
-            continue;
-            
-        } else if (bytes[0] >= 0xEC && bytes[0] <= 0xEF) {
-            dir = bytes[0] & 0x02;
-            op_text = dir ? "out" : "in";
-            u8 word = bytes[0] & 0x01;
-
-            if (dir) {
-                capture_instruction(address, "%s dx, %s\n", op_text, word ? "ax" : "al");
-            } else {
-                capture_instruction(address, "%s %s, dx\n", op_text, word ? "ax" : "al");
+        run_lanes(group);
+        
+#if defined(_DEBUG)
+        // Every lane has to end up where the scalar loop puts it.
+        for (int i = 0; i < lane_count; i++) {
+            Simulator reference;
+            init_simulator(&reference, &main_arena);
+            load_program(&reference, file.buffer, file.size);
+            reference.machine.registers[REGISTER_AX] = (u16)i;
+            StopReason reason = run(&reference);
+            
+            Simulator* lane = &group->lanes[i];
+            Machine* a = &lane->machine;
+            Machine* b = &reference.machine;
+            if (reason != group->lane_stops[i] || lane->instruction_count != reference.instruction_count ||
+                memcmp(a->registers, b->registers, sizeof(a->registers)) != 0 ||
+                memcmp(a->segment_registers, b->segment_registers, sizeof(a->segment_registers)) != 0 ||
+                a->ip != b->ip || a->flags != b->flags || memcmp(a->memory, b->memory, MEMORY_SIZE) != 0) {
+                critical_error("lane %d disagrees with the scalar simulator.", i);
             }
-            
-            i += 1;
-            continue;
-            
-        } else if (bytes[0] == 0xF3) {
-            if ((bytes[1] & 0xFE) == 0xAA) {
-                op_text = "stos";
-            } else if (bytes[1] & 0x08) {
-                op_text = (bytes[1] & 0x02) ? "scas" : "lods";
-            } else {
-                op_text = (bytes[1] & 0x02) ? "cmps" : "movs";
-            }
-            
-            word = bytes[1] & 0x01;
-            capture_instruction(address, "rep %s%s\n", op_text, word ? "w" : "b");
-            
-            i += 2;
-            continue;
+        }
+#endif
+        
+        bool all_halted = true;
+        for (int i = 0; i < lane_count; i++) {
+            Simulator* lane = &group->lanes[i];
+            StopReason reason = group->lane_stops[i];
+            printf("lane %d stopped: %s at %u after %llu instructions\n",
+                   i, stop_reason_names[reason], lane->stop_address, (unsigned long long)lane->instruction_count);
+            print_machine(lane);
+            all_halted = all_halted && (reason == STOP_HALT || reason == STOP_END_OF_CODE);
+        }
+        printf("lockstep: %llu steps, %llu vector, %llu scalar\n",
+               (unsigned long long)group->steps,
+               (unsigned long long)group->vector_steps,
+               (unsigned long long)group->scalar_steps);
         
-        } else if ((bytes[0] & 0xFE) == 0xF4) {
-            capture_instruction(address, "%s\n", (bytes[0] & 0x01) ? "cmc" : "hlt");
-            i += 1;
-            continue;
+        return all_halted ? 0 : 1;
+    }
+    
+    if (execute_program) {
+        Simulator sim;
+        init_simulator(&sim, &main_arena);
+        if (!load_program(&sim, file.buffer, file.size)) {
+            return 1;
+        }
         
-        } else if ((bytes[0] & 0xFE) == 0xF6) {
-            const char* mnemonics[] = {
-                "test",
-                "unused",
-                "not",
-                "neg",
-                "mul",
-                "imul",
-                "div",
-                "idiv",
-            };
-            
-            u8 op = (bytes[1] >> 3) & 0x07;
-            
-            if (op == 0) {
-                extract_data = true;
-                extract_word = word != 0;
-                op_class = OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY;
-            } else {
-                op_class = OP_CLASS_REGISTER_MEMORY;
-            }
-            
-            decode_register_memory = true;
-            op_text = mnemonics[op];
-            byte_count += 2;
+        if (trace) {
+            set_trace(&sim, trace_instruction, 0);
+        }
         
-        } else if (bytes[0] >= 0xF8 && bytes[0] <= 0xFD) {
-            u8 op = bytes[0] & 0x07;
-            
-            const char* mnemonics[] = {
-                "clc",
-                "stc",
-                "cli",
-                "sti",
-                "cld",
-                "std"
-            };
-            
-            op_text = mnemonics[op];
-            capture_instruction(address, "%s\n", op_text);
-            i += 1;
-            continue;
+        for (int i = 0; i < breakpoint_count; i++) {
+            add_breakpoint(&sim, breakpoints[i]);
+        }
+        for (int i = 0; i < watchpoint_count; i++) {
+            add_watchpoint(&sim, watchpoints[i]);
+        }
         
-        } else if ((bytes[0] & 0xFE) == 0xFE) {            
-            const char* mnemonics[] = {
-                "inc",
-                "dec",
-                "call",
-                "call far",
-                "jmp",
-                "jmp far",
-                "push"
-            };
-            
-            op_class = OP_CLASS_REGISTER_MEMORY;
-            decode_register_memory = true;
-            op_text = mnemonics[(bytes[1] >> 3) & 0x07]; 
-            byte_count += 2;
+        MicroOpCache micro_ops;
+        if (use_micro_ops) {
+            init_micro_ops(&sim, &micro_ops, &main_arena);
         }
-
-        char address_operand[32];
-        memset(address_operand, 0, 32);
-
-        StringBuilder sb = {};
-        sb.buffer = address_operand;
         
-        if (decode_register_memory) {
-            if (mode == MODE_REGISTER) {
-                const char** reg_table = word ? register_map_word : register_map_byte;
-                sb_appendf(&sb, reg_table[rm]); 
-            
-            } else {
-                short displacement = 0;
-                bool use_effective_address = true;
-                
-                if (mode == MODE_MEMORY_NO_DISPLACEMENT && rm == 6) {
-                    displacement = bytes[2] | (bytes[3] << 8);
-                    use_effective_address = false;
-                    byte_count += 2;
-            
-                } else if (mode == MODE_MEMORY_8_BIT_DISPLACEMENT) {
-                    u8 sign = bytes[2] & 0x80;
-                    if (sign) {
-                        displacement = 0xFF00;
-                    }
-                    displacement |= bytes[2];
-                    byte_count += 1;
-                
-                } else if (mode == MODE_MEMORY_16_BIT_DISPLACEMENT) {
-                    displacement = bytes[2] | (bytes[3] << 8);
-                    byte_count += 2;
-                }                    
-                
-                if (use_segment_override) {
-                   sb_appendf(&sb, "%s:", segments[segment_override]);
-                }
-                
-                sb_appendf(&sb, "[");
-                
-                if (use_effective_address) {
-                    sb_appendf(&sb, effective_address_table[rm]);
-                }
-                
-                if (displacement != 0) {
-                    sb_appendf(&sb, " + %hd", displacement);
-                }
-                
-                sb_appendf(&sb, "]");
+        StopReason reason;
+        if (use_micro_ops) {
+            // Lowered runs have no hooks, so they never stop at a breakpoint.
+            reason = run_lowered(&sim);
+        } else {
+            // Breakpoints and watchpoints just report and carry on.
+            reason = run(&sim);
+            while (reason == STOP_BREAKPOINT || reason == STOP_WATCHPOINT) {
+                print_stop(&sim, reason);
+                reason = run(&sim);
             }
         }
         
-        u16 data = 0;
-        if (extract_data) {
-            byte_count += extract_encoded_data(bytes, byte_count, extract_word, use_signed_immediate, &data);
-        }
+        printf("stopped: %s at %u after %llu instructions\n",
+               stop_reason_names[reason], sim.stop_address, (unsigned long long)sim.instruction_count);
+        print_machine(&sim);
         
-        switch (op_class) {
-            case OP_CLASS_SEG_REG: {
-                u8 sr = (bytes[1] >> 3) & 0x03;
-                capture_instruction(address, "%s %s, %s\n", op_text, address_operand, segments[sr]);
-                i += byte_count;
-                continue;
-            } break;
-            
-            case OP_CLASS_IMMEDIATE: {
-                const char* size_label = extract_word ? "word" : "byte";
-                capture_instruction(address, "%s %s %hu\n", op_text, size_label, data);
-                i += byte_count;
-                continue;
-            } break;
-            
-            case OP_CLASS_REGISTER_MEMORY: {            
-                const char* size_label = word ? "word" : "byte";
-                
-                if (is_bit_shift) {
-                    capture_instruction(address, "%s %s %s, %s\n", op_text, size_label, address_operand, bit_shift_type ? "cl" : "1");
-                } else {
-                    capture_instruction(address, "%s %s %s\n", op_text, size_label, address_operand);
-                }
-                
-                i += byte_count;
-                continue;
-            } break;
-                
-            case OP_CLASS_REGISTER_MEMORY_AND_REGISTER: {
-                u8 reg = (bytes[1] & 0x38) >> 3; 
-                
-                const char** reg_table = word ? register_map_word : register_map_byte; 
-                const char* reg_operand = reg_table[reg];
-                const char* dest   = dir ? reg_operand : address_operand;
-                const char* source = dir ? address_operand : reg_operand;
-                
-                capture_instruction(address, "%s %s, %s\n", op_text, dest, source);
+        return (reason == STOP_HALT || reason == STOP_END_OF_CODE) ? 0 : 1;
+    }
     
-                i += byte_count;
-                continue;
-            } break;
-            
-            case OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY: {
-                const char* size_label = extract_word ? "word" : "byte";
-                capture_instruction(address, "%s %s, %s %hu\n", op_text, address_operand, size_label, data);
+    STATS_BEGIN_PHASE(STATS_PHASE_DECODE);
+    DecodeContext decoder;
+    init_decode_context(&decoder);
     
-                i += byte_count;
-                continue;
-            } break;
-          
-            case OP_CLASS_IMMEDIATE_TO_ACCUMULATOR: {
-                const char* size_label = extract_word ? "word" : "byte";
-                const char* reg = word ? "ax" : "al";
-                
-                if (dir) {
-                    capture_instruction(address, "%s %s %hu, %s\n", op_text, size_label, data, reg);
-                } else {
-                    capture_instruction(address, "%s %s, %s %hu\n", op_text, reg, size_label, data);
-                }
-            
-                i += byte_count;    
-                continue;
-            } break;
+    if (sink_kind != SINK_TEXT) {
+        if (sink_kind == SINK_NULL) {
+            NullSink sink;
+            decode_file(&decoder, &file, &sink);
+        } else if (sink_kind == SINK_BINARY) {
+            BinarySink* sink = (BinarySink*)arena_alloc(&main_arena, sizeof(BinarySink), alignof(BinarySink));
+            init_binary_sink(sink, stdout);
+            decode_file(&decoder, &file, sink);
+            flush_binary_sink(sink);
+        } else {
+            CountSink sink = {};
+            decode_file(&decoder, &file, &sink);
+            print_counts(&sink);
         }
-        
-        fputs("Unable to decode byte: ", stderr);
-        print_byte(bytes[0], stderr);
-        fputc('\n', stderr);
-        ERROR_ABORT();
+        return 0;
     }
     
-    // Labels
-    int label_counter = 0;
-    int label_addresses[1024];
-    memset(label_addresses, 0, 1024 * sizeof(int)); 
+    // Lengths alone give the instruction count, so the store is sized once.
+    // A jump takes two bytes, which bounds how many there can be.
+    BoundaryIndex boundaries;
+    build_boundary_index(&boundaries, file.buffer, (int)file.size, &main_arena);
+    int max_jumps = (int)(file.size / 2 + 1);
+    reserve_instruction_store(&instructions, boundaries.count, boundaries.count < max_jumps ? boundaries.count : max_jumps);
     
-    for (int i = 0; i < instruction_count; i++) {
-        if (!instructions[i].is_jump) {
-            continue;
-        }
+    TextSink sink = { &instructions };
+    decode_file(&decoder, &file, &sink);
     
-        instructions[i].jump_address;
-
-        bool found = false;
-        for (int j = 0; j < label_counter; j++) {
-            if (label_addresses[j] == instructions[i].jump_address) {
-                found = true;
-                break;
-            } 
-        }
-        
-        if (found) {
-            continue;
-        }
-
-        label_addresses[label_counter] = instructions[i].jump_address;
-        label_counter++;
+#if defined(_DEBUG)
+    // The length-only decoder has to agree with decode_one() exactly.
+    if (boundaries.count != instructions.count) {
+        critical_error("boundary index has %d instructions, decoder has %d.", boundaries.count, instructions.count);
     }
-
-    int label_count = label_counter; 
-    bubble_sort(label_addresses, label_count);
     
-    label_counter = 0;
-    printf("bits 16\n");
-    for (int i = 0; i < instruction_count; i++) {
-        if (label_counter < label_count && label_addresses[label_counter] == instructions[i].address) {
-            printf("label_%d:\n", label_addresses[label_counter]);
-            label_counter++;
+    for (int i = 0; i < instructions.count; i++) {
+        int address = instructions.addresses[i];
+        int end = (i + 1 < instructions.count) ? (int)instructions.addresses[i + 1] : (int)file.size;
+        int last_byte = end - 1;
+        if (boundary_seek(&boundaries, i) != address || boundary_find(&boundaries, last_byte) != address) {
+            critical_error("boundary index disagrees with decoder at instruction %d (address %d).", i, address);
         }
+    }
+#endif
+    STATS_END_PHASE(STATS_PHASE_DECODE);
     
-        printf(instructions[i].string);
-        if (instructions[i].is_jump) {
-            printf(" label_%d\n", instructions[i].jump_address);
-        }
+    if (report_loops > 0) {
+        LoopAnalysis analysis;
+        analyze_loops(&analysis, &instructions, file.buffer, (int)file.size, &main_arena);
+        print_loop_report(&analysis, report_loops);
+        return 0;
+    }
+    
+    // Labels
+    STATS_BEGIN_PHASE(STATS_PHASE_LABELS);
+    int* label_addresses = (int*)main_arena_alloc((instructions.jump_count + 1) * sizeof(int));
+    memcpy(label_addresses, instructions.jump_targets, instructions.jump_count * sizeof(int));
+    sort_ints(label_addresses, instructions.jump_count);
+    int label_count = unique_ints(label_addresses, instructions.jump_count);
+    STATS_END_PHASE(STATS_PHASE_LABELS);
+    
+    STATS_BEGIN_PHASE(STATS_PHASE_EMIT);
+    int label_counter = emit_listing(&instructions, file.buffer, (int)file.size, label_addresses, label_count, stdout);
+    STATS_END_PHASE(STATS_PHASE_EMIT);
+
+    if (stats_format != STATS_FORMAT_NONE) {
+        STATS_SET(bytes_decoded, file.size);
+        STATS_SET(instructions_decoded, instructions.count);
+        STATS_SET(arena_high_water, main_arena.index);
+        STATS_SET(arena_capacity, main_arena.capacity);
+        STATS_SET(label_count, label_count);
+        STATS_SET(labels_emitted, label_counter);
+        STATS_SET(jump_count, instructions.jump_count);
+        
+        print_stats(stats_format);
     }
 
     return 0;
@@ -0,0 +1,577 @@
+#pragma once
+
+// Micro-op lowering and interpreter.
+//
+// lower_instruction() turns a decoded instruction into a short list of
+// uniform micro-ops that move values between the machine and a few
+// temporaries: compute an address, read, run an ALU step, write, change
+// flags or branch. Operand forms, segment overrides and shift counts are
+// all resolved while lowering, so execute_micro_ops() is one small switch.
+// lock has no effect on a single simulated CPU and is dropped.
+//
+// Lowered instructions are cached per physical address. Writes that land on
+// cached code invalidate it. Instructions with irregular semantics (string
+// ops, mul/div, far control transfers, interrupts, BCD adjusts, port I/O)
+// lower to a single UOP_EXECUTE that hands the instruction to execute().
+//
+// run_lowered() is an alternative to the bare run loop: it has no hooks, and
+// writes made through run() are not seen by the cache, so use one engine per
+// Simulator or call reset_micro_ops() when switching.
+
+#include "simulator.h"
+
+#define MAX_MICRO_OPS        8
+#define MICRO_OP_TEMPS       2
+#define MICRO_OP_CACHE_SIZE  4096    // entries, direct mapped by physical address
+#define NO_LOWERED_ADDRESS   0xFFFFFFFF
+
+enum MicroOpKind {
+    UOP_EA           = 0,   // address = segment base + kernel(registers, value)
+    UOP_DIRECT       = 1,   // address = segment base + value
+    UOP_LEA          = 2,   // t[dst] = kernel(registers, value)
+    UOP_IMMEDIATE    = 3,   // t[dst] = value
+    UOP_READ_REG     = 4,   // t[dst] = register src
+    UOP_READ_SEG     = 5,   // t[dst] = segment register src
+    UOP_READ_IP      = 6,   // t[dst] = ip
+    UOP_READ_MEM     = 7,   // t[dst] = [address]
+    UOP_ALU          = 8,   // t[dst] = t[dst] op t[src], flags as alu()
+    UOP_STEP         = 9,   // t[dst] += 1 (op 1) or -= 1 (op 0), CF kept
+    UOP_SHIFT        = 10,  // t[dst] = shift op of t[dst] by t[src]
+    UOP_NOT          = 11,  // t[dst] = ~t[dst]
+    UOP_WRITE_REG    = 12,  // register dst = t[src]
+    UOP_WRITE_SEG    = 13,  // segment register dst = t[src]
+    UOP_WRITE_MEM    = 14,  // [address] = t[src]
+    UOP_PUSH         = 15,  // push t[src]
+    UOP_POP          = 16,  // t[dst] = pop
+    UOP_FLAGS        = 17,  // op: clear, set or toggle the flags in value
+    UOP_BRANCH       = 18,  // op: a MicroOpBranch
+    UOP_HALT         = 19,
+    UOP_EXECUTE      = 20,  // run the cached DecodedInstruction through execute()
+};
+
+enum MicroOpFlags {
+    UOP_FLAGS_CLEAR  = 0,
+    UOP_FLAGS_SET    = 1,
+    UOP_FLAGS_TOGGLE = 2,
+};
+
+// Relative branches carry the displacement from the next instruction in
+// value, so a cached entry is right whatever CS:IP reached it.
+enum MicroOpBranch {
+    BRANCH_ALWAYS    = 0,
+    BRANCH_CONDITION = 1,   // condition code in src
+    BRANCH_LOOP      = 2,
+    BRANCH_LOOPZ     = 3,
+    BRANCH_LOOPNZ    = 4,
+    BRANCH_CXZ       = 5,
+    BRANCH_INDIRECT  = 6,   // ip = t[src]
+};
+
+struct MicroOp {
+    u8 kind;
+    u8 op;
+    u8 dst;
+    u8 src;
+    bool word;
+    u8 segment;
+    u16 value;
+    EffectiveAddressKernel kernel;
+};
+
+struct LoweredInstruction {
+    u32 address;                       // physical, or NO_LOWERED_ADDRESS
+    u8 length;
+    u8 count;
+    MicroOp ops[MAX_MICRO_OPS];
+    DecodedInstruction instruction;    // for UOP_EXECUTE
+};
+
+struct MicroOpCache {
+    LoweredInstruction* entries;       // MICRO_OP_CACHE_SIZE
+    u64* code;                         // ADDRESS_BITMAP_WORDS, bytes covered by an entry
+
+    u64 lowered;
+    u64 invalidated;
+};
+
+void reset_micro_ops(MicroOpCache* cache) {
+    for (int i = 0; i < MICRO_OP_CACHE_SIZE; i++) {
+        cache->entries[i].address = NO_LOWERED_ADDRESS;
+    }
+    memset(cache->code, 0, ADDRESS_BITMAP_WORDS * sizeof(u64));
+}
+
+void init_micro_ops(Simulator* sim, MicroOpCache* cache, MemoryArena* arena) {
+    *cache = {};
+    cache->entries = (LoweredInstruction*)arena_alloc(arena, MICRO_OP_CACHE_SIZE * sizeof(LoweredInstruction));
+    cache->code = (u64*)arena_alloc(arena, ADDRESS_BITMAP_WORDS * sizeof(u64));
+    reset_micro_ops(cache);
+    sim->micro_ops = cache;
+}
+
+// Drops every entry whose bytes include address.
+void invalidate_micro_ops(MicroOpCache* cache, u32 address) {
+    for (int back = 0; back < DECODE_MAX_INSTRUCTION_LENGTH; back++) {
+        u32 start = (address - back) & MEMORY_ACCESS_MASK;
+        LoweredInstruction* lowered = &cache->entries[start & (MICRO_OP_CACHE_SIZE - 1)];
+        if (lowered->address == start && back < lowered->length) {
+            lowered->address = NO_LOWERED_ADDRESS;
+            cache->invalidated += 1;
+        }
+    }
+}
+
+struct LoweredHooks {
+    static const bool watches = false;
+
+    static inline bool stop_before(Simulator*, u32) { return false; }
+
+    static inline void on_write(Simulator* sim, u32 address) {
+        if (test_address(sim->micro_ops->code, address)) {
+            invalidate_micro_ops(sim->micro_ops, address);
+        }
+    }
+
+    static inline void after(Simulator*, u32, DecodedInstruction*) {}
+};
+
+//
+// Lowering
+//
+
+#define T0 0
+#define T1 1
+
+inline MicroOp* emit_op(LoweredInstruction* lowered, u8 kind, u8 dst = 0, u8 src = 0, bool word = true, u16 value = 0) {
+    MicroOp* op = &lowered->ops[lowered->count];
+    lowered->count += 1;
+
+    *op = {};
+    op->kind = kind;
+    op->dst = dst;
+    op->src = src;
+    op->word = word;
+    op->value = value;
+    return op;
+}
+
+// Loads the address of a memory operand. Must come before reading or
+// writing it.
+inline void lower_address(LoweredInstruction* lowered, DecodedInstruction* instruction) {
+    if (!instruction->rm_is_register) {
+        EffectiveAddress* ea = &instruction->ea;
+        MicroOp* op = emit_op(lowered, UOP_EA, 0, 0, true, (u16)ea->displacement);
+        op->kernel = ea->form->kernel;
+        op->segment = ea->segment;
+    }
+}
+
+inline void lower_read_rm(LoweredInstruction* lowered, DecodedInstruction* instruction, u8 temp, bool word) {
+    if (instruction->rm_is_register) {
+        emit_op(lowered, UOP_READ_REG, temp, instruction->rm, word);
+    } else {
+        emit_op(lowered, UOP_READ_MEM, temp, 0, word);
+    }
+}
+
+inline void lower_write_rm(LoweredInstruction* lowered, DecodedInstruction* instruction, u8 temp, bool word) {
+    if (instruction->rm_is_register) {
+        emit_op(lowered, UOP_WRITE_REG, instruction->rm, temp, word);
+    } else {
+        emit_op(lowered, UOP_WRITE_MEM, 0, temp, word);
+    }
+}
+
+inline void lower_alu(LoweredInstruction* lowered, u8 alu_op, bool word) {
+    emit_op(lowered, UOP_ALU, T0, T1, word)->op = alu_op;
+}
+
+inline void lower_branch(LoweredInstruction* lowered, u8 branch, u16 displacement, u8 src = 0) {
+    emit_op(lowered, UOP_BRANCH, 0, src, true, displacement)->op = branch;
+}
+
+inline void lower_flags(LoweredInstruction* lowered, u8 change, u16 flags) {
+    emit_op(lowered, UOP_FLAGS, 0, 0, true, flags)->op = change;
+}
+
+// Fills lowered->ops for a decoded instruction. Anything without a lowering
+// becomes UOP_EXECUTE.
+void lower_instruction(DecodedInstruction* instruction, LoweredInstruction* lowered) {
+    u8 op = instruction->opcode;
+    u8 reg = instruction->reg;
+    bool word = instruction->word;
+    u16 displacement = (u16)(instruction->target - (instruction->address + instruction->length));
+
+    lowered->count = 0;
+    lowered->length = instruction->length;
+    lowered->instruction = *instruction;
+
+    switch (instruction->op_class) {
+        case OP_CLASS_REGISTER_MEMORY_AND_REGISTER: {
+            if (op == 0xC4 || op == 0xC5 || (op == 0x8D && instruction->rm_is_register)) {
+                break;
+            }
+
+            if (op == 0x8D) {                              // lea
+                MicroOp* lea = emit_op(lowered, UOP_LEA, T0, 0, true, (u16)instruction->ea.displacement);
+                lea->kernel = instruction->ea.form->kernel;
+                emit_op(lowered, UOP_WRITE_REG, reg, T0, true);
+                break;
+            }
+
+            lower_address(lowered, instruction);
+
+            if (op <= 0x3F) {
+                u8 alu_op = (op >> 3) & 0x07;
+                if (instruction->dir) {
+                    emit_op(lowered, UOP_READ_REG, T0, reg, word);
+                    lower_read_rm(lowered, instruction, T1, word);
+                    lower_alu(lowered, alu_op, word);
+                    if (alu_op != ALU_CMP) {
+                        emit_op(lowered, UOP_WRITE_REG, reg, T0, word);
+                    }
+                } else {
+                    lower_read_rm(lowered, instruction, T0, word);
+                    emit_op(lowered, UOP_READ_REG, T1, reg, word);
+                    lower_alu(lowered, alu_op, word);
+                    if (alu_op != ALU_CMP) {
+                        lower_write_rm(lowered, instruction, T0, word);
+                    }
+                }
+            } else if (op == 0x84 || op == 0x85) {         // test
+                lower_read_rm(lowered, instruction, T0, word);
+                emit_op(lowered, UOP_READ_REG, T1, reg, word);
+                lower_alu(lowered, ALU_AND, word);
+            } else if (op == 0x86 || op == 0x87) {         // xchg
+                lower_read_rm(lowered, instruction, T0, word);
+                emit_op(lowered, UOP_READ_REG, T1, reg, word);
+                lower_write_rm(lowered, instruction, T1, word);
+                emit_op(lowered, UOP_WRITE_REG, reg, T0, word);
+            } else {                                       // mov
+                if (instruction->dir) {
+                    lower_read_rm(lowered, instruction, T0, word);
+                    emit_op(lowered, UOP_WRITE_REG, reg, T0, word);
+                } else {
+                    emit_op(lowered, UOP_READ_REG, T0, reg, word);
+                    lower_write_rm(lowered, instruction, T0, word);
+                }
+            }
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY: {
+            lower_address(lowered, instruction);
+
+            if (op == 0xC6 || op == 0xC7) {                // mov
+                emit_op(lowered, UOP_IMMEDIATE, T0, 0, word, instruction->data);
+                lower_write_rm(lowered, instruction, T0, word);
+            } else {
+                u8 alu_op = (op == 0xF6 || op == 0xF7) ? (u8)ALU_AND : reg;
+                lower_read_rm(lowered, instruction, T0, word);
+                emit_op(lowered, UOP_IMMEDIATE, T1, 0, word, instruction->data);
+                lower_alu(lowered, alu_op, word);
+                if (alu_op != ALU_CMP && op != 0xF6 && op != 0xF7) {
+                    lower_write_rm(lowered, instruction, T0, word);
+                }
+            }
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_ACCUMULATOR: {
+            if (op > 0x3F && op != 0xA8 && op != 0xA9) {   // in, out
+                break;
+            }
+
+            u8 alu_op = (op <= 0x3F) ? (op >> 3) & 0x07 : ALU_AND;
+            emit_op(lowered, UOP_READ_REG, T0, REGISTER_AX, word);
+            emit_op(lowered, UOP_IMMEDIATE, T1, 0, word, instruction->data);
+            lower_alu(lowered, alu_op, word);
+            if (op <= 0x3F && alu_op != ALU_CMP) {
+                emit_op(lowered, UOP_WRITE_REG, REGISTER_AX, T0, word);
+            }
+        } break;
+
+        case OP_CLASS_REGISTER: {
+            if (op < 0x50) {                               // inc, dec
+                emit_op(lowered, UOP_READ_REG, T0, reg, true);
+                emit_op(lowered, UOP_STEP, T0, 0, true)->op = op < 0x48;
+                emit_op(lowered, UOP_WRITE_REG, reg, T0, true);
+            } else if (op < 0x58) {                        // push
+                if (reg == REGISTER_SP) {
+                    break;
+                }
+                emit_op(lowered, UOP_READ_REG, T0, reg, true);
+                emit_op(lowered, UOP_PUSH, 0, T0);
+            } else {                                       // pop
+                emit_op(lowered, UOP_POP, T0);
+                emit_op(lowered, UOP_WRITE_REG, reg, T0, true);
+            }
+        } break;
+
+        case OP_CLASS_SEGMENT: {
+            if (op & 0x01) {
+                emit_op(lowered, UOP_POP, T0);
+                emit_op(lowered, UOP_WRITE_SEG, reg, T0);
+            } else {
+                emit_op(lowered, UOP_READ_SEG, T0, reg);
+                emit_op(lowered, UOP_PUSH, 0, T0);
+            }
+        } break;
+
+        case OP_CLASS_ACCUMULATOR_REGISTER: {
+            emit_op(lowered, UOP_READ_REG, T0, REGISTER_AX, true);
+            emit_op(lowered, UOP_READ_REG, T1, reg, true);
+            emit_op(lowered, UOP_WRITE_REG, REGISTER_AX, T1, true);
+            emit_op(lowered, UOP_WRITE_REG, reg, T0, true);
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER: {
+            emit_op(lowered, UOP_IMMEDIATE, T0, 0, word, instruction->data);
+            emit_op(lowered, UOP_WRITE_REG, reg, T0, word);
+        } break;
+
+        case OP_CLASS_ACCUMULATOR_MEMORY: {
+            u8 segment = instruction->has_segment_override ? instruction->segment_override : (u8)SEGMENT_DS;
+            emit_op(lowered, UOP_DIRECT, 0, 0, true, instruction->data)->segment = segment;
+            if (instruction->dir) {
+                emit_op(lowered, UOP_READ_REG, T0, REGISTER_AX, word);
+                emit_op(lowered, UOP_WRITE_MEM, 0, T0, word);
+            } else {
+                emit_op(lowered, UOP_READ_MEM, T0, 0, word);
+                emit_op(lowered, UOP_WRITE_REG, REGISTER_AX, T0, word);
+            }
+        } break;
+
+        case OP_CLASS_SEG_REG: {
+            lower_address(lowered, instruction);
+            if (op == 0x8C) {
+                emit_op(lowered, UOP_READ_SEG, T0, reg);
+                lower_write_rm(lowered, instruction, T0, true);
+            } else {
+                lower_read_rm(lowered, instruction, T0, true);
+                emit_op(lowered, UOP_WRITE_SEG, reg, T0);
+            }
+        } break;
+
+        case OP_CLASS_REGISTER_MEMORY: {
+            if (op == 0x8F) {                              // pop
+                lower_address(lowered, instruction);
+                emit_op(lowered, UOP_POP, T0);
+                lower_write_rm(lowered, instruction, T0, true);
+            } else if (instruction->is_bit_shift) {
+                lower_address(lowered, instruction);
+                lower_read_rm(lowered, instruction, T0, word);
+                if (instruction->shift_by_cl) {
+                    emit_op(lowered, UOP_READ_REG, T1, REGISTER_CX, false);
+                } else {
+                    emit_op(lowered, UOP_IMMEDIATE, T1, 0, false, 1);
+                }
+                emit_op(lowered, UOP_SHIFT, T0, T1, word)->op = reg;
+                lower_write_rm(lowered, instruction, T0, word);
+            } else if ((op == 0xF6 || op == 0xF7) && (reg == 2 || reg == 3)) {
+                lower_address(lowered, instruction);
+                if (reg == 2) {                            // not
+                    lower_read_rm(lowered, instruction, T0, word);
+                    emit_op(lowered, UOP_NOT, T0, 0, word);
+                } else {                                   // neg, as 0 - value
+                    lower_read_rm(lowered, instruction, T1, word);
+                    emit_op(lowered, UOP_IMMEDIATE, T0, 0, word, 0);
+                    lower_alu(lowered, ALU_SUB, word);
+                }
+                lower_write_rm(lowered, instruction, T0, word);
+            } else if ((op == 0xFE || op == 0xFF) && reg <= 1) {  // inc, dec
+                lower_address(lowered, instruction);
+                lower_read_rm(lowered, instruction, T0, word);
+                emit_op(lowered, UOP_STEP, T0, 0, word)->op = reg == 0;
+                lower_write_rm(lowered, instruction, T0, word);
+            } else if (op == 0xFF && (reg == 2 || reg == 4)) {    // call, jmp
+                lower_address(lowered, instruction);
+                lower_read_rm(lowered, instruction, T0, true);
+                if (reg == 2) {
+                    emit_op(lowered, UOP_READ_IP, T1);
+                    emit_op(lowered, UOP_PUSH, 0, T1);
+                }
+                lower_branch(lowered, BRANCH_INDIRECT, 0, T0);
+            } else if (op == 0xFF && reg == 6 && !(instruction->rm_is_register && instruction->rm == REGISTER_SP)) {
+                lower_address(lowered, instruction);       // push
+                lower_read_rm(lowered, instruction, T0, true);
+                emit_op(lowered, UOP_PUSH, 0, T0);
+            }
+        } break;
+
+        case OP_CLASS_JUMP: {
+            switch (op) {
+                case 0xE0: lower_branch(lowered, BRANCH_LOOPNZ, displacement); break;
+                case 0xE1: lower_branch(lowered, BRANCH_LOOPZ, displacement);  break;
+                case 0xE2: lower_branch(lowered, BRANCH_LOOP, displacement);   break;
+                case 0xE3: lower_branch(lowered, BRANCH_CXZ, displacement);    break;
+                default:   lower_branch(lowered, BRANCH_CONDITION, displacement, op & 0x0F); break;
+            }
+        } break;
+
+        case OP_CLASS_NEAR_RELATIVE: {
+            if (op == 0xE8) {
+                emit_op(lowered, UOP_READ_IP, T0);
+                emit_op(lowered, UOP_PUSH, 0, T0);
+            }
+            lower_branch(lowered, BRANCH_ALWAYS, displacement);
+        } break;
+
+        case OP_CLASS_SHORT_RELATIVE: {
+            lower_branch(lowered, BRANCH_ALWAYS, displacement);
+        } break;
+
+        case OP_CLASS_NONE: {
+            switch (op) {
+                case 0x9B: break;                          // wait
+                case 0xC3: {                               // ret
+                    emit_op(lowered, UOP_POP, T0);
+                    lower_branch(lowered, BRANCH_INDIRECT, 0, T0);
+                } break;
+                case 0xF4: emit_op(lowered, UOP_HALT); break;
+                case 0xF5: lower_flags(lowered, UOP_FLAGS_TOGGLE, FLAG_CF); break;
+                case 0xF8: lower_flags(lowered, UOP_FLAGS_CLEAR, FLAG_CF);  break;
+                case 0xF9: lower_flags(lowered, UOP_FLAGS_SET, FLAG_CF);    break;
+                case 0xFA: lower_flags(lowered, UOP_FLAGS_CLEAR, FLAG_IF);  break;
+                case 0xFB: lower_flags(lowered, UOP_FLAGS_SET, FLAG_IF);    break;
+                case 0xFC: lower_flags(lowered, UOP_FLAGS_CLEAR, FLAG_DF);  break;
+                case 0xFD: lower_flags(lowered, UOP_FLAGS_SET, FLAG_DF);    break;
+                default: {
+                    emit_op(lowered, UOP_EXECUTE);
+                } break;
+            }
+            return;
+        } break;
+
+        // int, in/out through dx, string ops and far transfers have no
+        // lowering and go through execute().
+        case OP_CLASS_IMMEDIATE:
+        case OP_CLASS_ACCUMULATOR_DX:
+        case OP_CLASS_STRING:
+        case OP_CLASS_FAR_POINTER: {
+        } break;
+    }
+
+    if (lowered->count == 0) {
+        emit_op(lowered, UOP_EXECUTE);
+    }
+}
+
+#undef T0
+#undef T1
+
+//
+// Interpreter
+//
+
+template <typename Hooks>
+StopReason execute_micro_ops(Simulator* sim, LoweredInstruction* lowered, u32 fetch) {
+    Machine* m = &sim->machine;
+    u16 t[MICRO_OP_TEMPS] = {};
+    u32 address = 0;
+
+    MicroOp* end = lowered->ops + lowered->count;
+    for (MicroOp* u = lowered->ops; u < end; u++) {
+        switch (u->kind) {
+            case UOP_EA:        address = physical_address(m, u->segment, u->kernel(m->registers, u->value)); break;
+            case UOP_DIRECT:    address = physical_address(m, u->segment, u->value); break;
+            case UOP_LEA:       t[u->dst] = u->kernel(m->registers, u->value); break;
+            case UOP_IMMEDIATE: t[u->dst] = u->value; break;
+            case UOP_READ_REG:  t[u->dst] = read_register(m, u->src, u->word); break;
+            case UOP_READ_SEG:  t[u->dst] = m->segment_registers[u->src]; break;
+            case UOP_READ_IP:   t[u->dst] = m->ip; break;
+            case UOP_READ_MEM:  t[u->dst] = read_memory(m, address, u->word); break;
+            case UOP_ALU:       t[u->dst] = alu(m, u->op, t[u->dst], t[u->src], u->word); break;
+            case UOP_STEP:      t[u->dst] = step_value(m, t[u->dst], u->word, u->op != 0); break;
+            case UOP_SHIFT:     t[u->dst] = shift(m, u->op, t[u->dst], (u8)t[u->src], u->word); break;
+            case UOP_NOT:       t[u->dst] = ~t[u->dst]; break;
+            case UOP_WRITE_REG: write_register(m, u->dst, t[u->src], u->word); break;
+            case UOP_WRITE_SEG: m->segment_registers[u->dst] = t[u->src]; break;
+            case UOP_WRITE_MEM: write_memory<Hooks>(sim, address, t[u->src], u->word); break;
+            case UOP_PUSH:      push<Hooks>(sim, t[u->src]); break;
+            case UOP_POP:       t[u->dst] = pop(m); break;
+
+            case UOP_FLAGS: {
+                switch (u->op) {
+                    case UOP_FLAGS_CLEAR:  m->flags &= ~u->value; break;
+                    case UOP_FLAGS_SET:    m->flags |= u->value;  break;
+                    case UOP_FLAGS_TOGGLE: m->flags ^= u->value;  break;
+                }
+            } break;
+
+            case UOP_BRANCH: {
+                u16* cx = &m->registers[REGISTER_CX];
+                bool taken = true;
+                switch (u->op) {
+                    case BRANCH_CONDITION: taken = condition(m->flags, u->src); break;
+                    case BRANCH_LOOP:      taken = --*cx != 0; break;
+                    case BRANCH_LOOPZ:     taken = --*cx != 0 && get_flag(m, FLAG_ZF); break;
+                    case BRANCH_LOOPNZ:    taken = --*cx != 0 && !get_flag(m, FLAG_ZF); break;
+                    case BRANCH_CXZ:       taken = *cx == 0; break;
+                    case BRANCH_INDIRECT:  m->ip = t[u->src]; taken = false; break;
+                }
+                if (taken) {
+                    m->ip += u->value;
+                }
+            } break;
+
+            case UOP_HALT:    return STOP_HALT;
+            case UOP_EXECUTE: return execute<Hooks>(sim, &lowered->instruction, fetch);
+        }
+    }
+
+    return STOP_NONE;
+}
+
+// Lowers the instruction at a physical address into its cache slot.
+bool lower_at(Simulator* sim, LoweredInstruction* lowered, u32 address) {
+    Machine* m = &sim->machine;
+    MicroOpCache* cache = sim->micro_ops;
+
+    DecodedInstruction instruction;
+    if (!decode_one(&sim->decoder, &m->memory[address], MEMORY_SIZE - address, m->ip, &instruction)) {
+        return false;
+    }
+
+    lower_instruction(&instruction, lowered);
+    lowered->address = address;
+    cache->lowered += 1;
+
+    for (int i = 0; i < instruction.length; i++) {
+        u32 byte = (address + i) & MEMORY_ACCESS_MASK;
+        cache->code[byte >> 6] |= 1ull << (byte & 63);
+    }
+    return true;
+}
+
+// run() without hooks, executing cached micro-ops. Needs init_micro_ops().
+StopReason run_lowered(Simulator* sim, u64 max_instructions = ~0ull) {
+    Machine* m = &sim->machine;
+    LoweredInstruction* entries = sim->micro_ops->entries;
+
+    for (u64 n = 0; n < max_instructions; n++) {
+        u32 address = physical_address(m, SEGMENT_CS, m->ip);
+        if (address >= sim->code_end) {
+            return stop(sim, STOP_END_OF_CODE, address);
+        }
+
+        LoweredInstruction* lowered = &entries[address & (MICRO_OP_CACHE_SIZE - 1)];
+        if (lowered->address != address && !lower_at(sim, lowered, address)) {
+            return stop(sim, STOP_INVALID_INSTRUCTION, address);
+        }
+
+        u16 ip = m->ip;
+        m->ip += lowered->length;
+
+        StopReason reason = execute_micro_ops<LoweredHooks>(sim, lowered, address);
+        if (reason == STOP_UNSUPPORTED_INSTRUCTION) {
+            m->ip = ip;
+            return stop(sim, reason, address);
+        }
+
+        sim->instruction_count += 1;
+        if (reason != STOP_NONE) {
+            return stop(sim, reason, address);
+        }
+    }
+
+    return stop(sim, STOP_INSTRUCTION_LIMIT, physical_address(m, SEGMENT_CS, m->ip));
+}
@@ -0,0 +1,340 @@
+#pragma once
+
+// Pipelined disassembly: reader -> decoder -> formatter -> writer.
+//
+// Each stage has its own thread and hands fixed-size batches to the next
+// through a bounded single-producer/single-consumer ring. A full ring makes
+// the producer wait, so memory stays bounded whatever the input size and
+// the pipeline runs at the pace of its slowest stage.
+//
+// Output matches the single-threaded listing byte for byte. Labels need no
+// second pass because every jump that gets a label (OP_CLASS_JUMP) is rel8:
+// once the decoder is LABEL_LOOKAHEAD bytes past a batch, every jump that
+// can target an address in it has been seen. The listing's label rule is
+// that a target gets a line if it starts an instruction and no smaller
+// target fails to, which the decoder checks in address order.
+//
+// Jump targets are kept in a bitmap window that slides along with the
+// decoder, so memory stays bounded whatever the input size. Addresses in
+// the listing are ints, which limits input to 2 GB.
+//
+// If the input cannot be decoded, the listing up to the bad byte has
+// already been written when the error is reported.
+
+#include <atomic>
+#include <new>
+#include <thread>
+
+#include "decoder.h"
+#include "format.h"
+
+#define READ_BATCH_SIZE        (64 * 1024)
+#define INSTRUCTION_BATCH_SIZE 1024
+#define PIPELINE_RING_SIZE     4
+
+// Jumps reach at most 128 bytes past themselves.
+#define LABEL_LOOKAHEAD 256
+
+// "label_-2147483648:\n"
+#define MAX_LABEL_TEXT 24
+
+// Bits of the sliding target window. Has to span the two batches the
+// decoder holds plus the reach of a jump past them.
+#define TARGET_WINDOW (64 * 1024)
+#define TARGET_WINDOW_MASK (TARGET_WINDOW - 1)
+
+static_assert(TARGET_WINDOW >= 2 * INSTRUCTION_BATCH_SIZE * DECODE_MAX_INSTRUCTION_LENGTH + LABEL_LOOKAHEAD,
+              "the target window must cover every unresolved target");
+
+template <typename T, int N>
+struct SpscRing {
+    alignas(64) std::atomic<u32> head;    // next slot to publish, written by the producer
+    alignas(64) std::atomic<u32> tail;    // next slot to consume, written by the consumer
+    std::atomic<bool> closed;
+
+    T slots[N];
+};
+
+// Waits for a free slot. The slot is not visible until ring_publish().
+template <typename T, int N>
+T* ring_write_slot(SpscRing<T, N>* ring) {
+    u32 head = ring->head.load(std::memory_order_relaxed);
+    while (head - ring->tail.load(std::memory_order_acquire) == N) {
+        std::this_thread::yield();
+    }
+    return &ring->slots[head % N];
+}
+
+template <typename T, int N>
+void ring_publish(SpscRing<T, N>* ring) {
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+template <typename T, int N>
+void ring_close(SpscRing<T, N>* ring) {
+    ring->closed.store(true, std::memory_order_release);
+}
+
+// Waits for the next published slot. Returns 0 once the ring is closed and
+// drained.
+template <typename T, int N>
+T* ring_read_slot(SpscRing<T, N>* ring) {
+    u32 tail = ring->tail.load(std::memory_order_relaxed);
+    while (tail == ring->head.load(std::memory_order_acquire)) {
+        if (ring->closed.load(std::memory_order_acquire) && tail == ring->head.load(std::memory_order_acquire)) {
+            return 0;
+        }
+        std::this_thread::yield();
+    }
+    return &ring->slots[tail % N];
+}
+
+template <typename T, int N>
+void ring_release(SpscRing<T, N>* ring) {
+    ring->tail.store(ring->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+struct ReadBatch {
+    int length;
+    u8 bytes[READ_BATCH_SIZE];
+};
+
+struct InstructionBatch {
+    int count;
+    bool labels[INSTRUCTION_BATCH_SIZE];
+    DecodedInstruction instructions[INSTRUCTION_BATCH_SIZE];
+};
+
+struct TextBatch {
+    int length;
+    char text[INSTRUCTION_BATCH_SIZE * (MAX_INSTRUCTION_TEXT + MAX_LABEL_TEXT)];
+};
+
+struct Pipeline {
+    FILE* input;
+    FILE* output;
+    u64 size;
+
+    SpscRing<ReadBatch, PIPELINE_RING_SIZE> read_ring;
+    SpscRing<InstructionBatch, PIPELINE_RING_SIZE> instruction_ring;
+    SpscRing<TextBatch, PIPELINE_RING_SIZE> text_ring;
+
+    // Decoder state
+    DecodeContext decoder;
+    u8 window[DECODE_MAX_INSTRUCTION_LENGTH + READ_BATCH_SIZE];
+    u64 targets[TARGET_WINDOW / 64];  // bit a & TARGET_WINDOW_MASK: a jump targets a
+    int first_bad_target;      // smallest target known not to start an instruction
+    InstructionBatch batches[2];
+
+    bool failed;
+};
+
+inline bool test_target(Pipeline* p, int address) {
+    int bit = address & TARGET_WINDOW_MASK;
+    return (p->targets[bit >> 6] >> (bit & 63)) & 1;
+}
+
+inline void set_target(Pipeline* p, int address) {
+    int bit = address & TARGET_WINDOW_MASK;
+    p->targets[bit >> 6] |= 1ull << (bit & 63);
+}
+
+inline void clear_target(Pipeline* p, int address) {
+    int bit = address & TARGET_WINDOW_MASK;
+    p->targets[bit >> 6] &= ~(1ull << (bit & 63));
+}
+
+void read_stage(Pipeline* p) {
+    for (;;) {
+        ReadBatch* batch = ring_write_slot(&p->read_ring);
+        batch->length = (int)fread(batch->bytes, 1, READ_BATCH_SIZE, p->input);
+        if (batch->length <= 0) {
+            break;
+        }
+        ring_publish(&p->read_ring);
+    }
+    ring_close(&p->read_ring);
+}
+
+// Decides which instructions in a batch get a label line. Every jump that
+// can target the batch must have been decoded. The batch's bits are cleared
+// so the window can move past it.
+void resolve_labels(Pipeline* p, InstructionBatch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        DecodedInstruction* instruction = &batch->instructions[i];
+        int address = instruction->address;
+        batch->labels[i] = test_target(p, address) && address < p->first_bad_target;
+        clear_target(p, address);
+
+        for (int inside = address + 1; inside < address + instruction->length; inside++) {
+            if (test_target(p, inside) && inside < p->first_bad_target) {
+                p->first_bad_target = inside;
+            }
+            clear_target(p, inside);
+        }
+    }
+}
+
+void publish_batch(Pipeline* p, InstructionBatch* batch) {
+    resolve_labels(p, batch);
+    InstructionBatch* slot = ring_write_slot(&p->instruction_ring);
+    slot->count = batch->count;
+    memcpy(slot->labels, batch->labels, batch->count * sizeof(bool));
+    memcpy(slot->instructions, batch->instructions, batch->count * sizeof(DecodedInstruction));
+    ring_publish(&p->instruction_ring);
+}
+
+void decode_stage(Pipeline* p) {
+    // A full batch is held back until the next one is full as well, which
+    // puts the decoder at least INSTRUCTION_BATCH_SIZE bytes past it.
+    static_assert(INSTRUCTION_BATCH_SIZE >= LABEL_LOOKAHEAD, "batches must cover the label lookahead");
+
+    InstructionBatch* current = &p->batches[0];
+    InstructionBatch* pending = 0;
+    current->count = 0;
+
+    int carry = 0;       // undecoded bytes kept from the previous read batch
+    int base = 0;        // address of window[0]
+    bool last = false;
+
+    while (!last && !p->failed) {
+        int available = carry;
+        ReadBatch* batch = ring_read_slot(&p->read_ring);
+        if (batch) {
+            memcpy(&p->window[carry], batch->bytes, batch->length);
+            available += batch->length;
+            ring_release(&p->read_ring);
+        } else {
+            last = true;
+        }
+
+        // Without more input on the way, an instruction must fit in what is
+        // left; otherwise wait until a whole one is in the window.
+        int i = 0;
+        while (i < available && (last || available - i >= DECODE_MAX_INSTRUCTION_LENGTH)) {
+            DecodedInstruction* instruction = &current->instructions[current->count];
+            int length = decode_one(&p->decoder, &p->window[i], available - i, base + i, instruction);
+            if (length == 0) {
+                p->failed = true;
+                break;
+            }
+
+            if (instruction->op_class == OP_CLASS_JUMP) {
+                int target = instruction->target;
+                if (target < 0) {
+                    if (target < p->first_bad_target) {
+                        p->first_bad_target = target;
+                    }
+                } else if ((u64)target < p->size) {
+                    set_target(p, target);
+                }
+            }
+
+            i += length;
+            current->count += 1;
+
+            if (current->count == INSTRUCTION_BATCH_SIZE) {
+                if (pending) {
+                    publish_batch(p, pending);
+                }
+                pending = current;
+                current = (current == &p->batches[0]) ? &p->batches[1] : &p->batches[0];
+                current->count = 0;
+            }
+        }
+
+        carry = available - i;
+        memmove(p->window, &p->window[i], carry);
+        base += i;
+    }
+
+    if (pending) {
+        publish_batch(p, pending);
+    }
+    if (current->count > 0) {
+        publish_batch(p, current);
+    }
+    ring_close(&p->instruction_ring);
+
+    // Let the reader finish if decoding stopped early.
+    while (ring_read_slot(&p->read_ring)) {
+        ring_release(&p->read_ring);
+    }
+}
+
+void format_stage(Pipeline* p) {
+    for (;;) {
+        InstructionBatch* batch = ring_read_slot(&p->instruction_ring);
+        if (!batch) {
+            break;
+        }
+
+        TextBatch* text = ring_write_slot(&p->text_ring);
+        char* out = text->text;
+        for (int i = 0; i < batch->count; i++) {
+            DecodedInstruction* instruction = &batch->instructions[i];
+            if (batch->labels[i]) {
+                out = append_text(out, TEXT("label_"));
+                out = append_i32(out, instruction->address);
+                out = append_text(out, TEXT(":\n"));
+            }
+            out += render_instruction(instruction, out);
+        }
+        text->length = (int)(out - text->text);
+
+        ring_release(&p->instruction_ring);
+        ring_publish(&p->text_ring);
+    }
+    ring_close(&p->text_ring);
+}
+
+void write_stage(Pipeline* p) {
+    fputs("bits 16\n", p->output);
+    for (;;) {
+        TextBatch* text = ring_read_slot(&p->text_ring);
+        if (!text) {
+            break;
+        }
+        fwrite(text->text, 1, text->length, p->output);
+        ring_release(&p->text_ring);
+    }
+    fflush(p->output);
+}
+
+// Disassembles a file to output with one thread per stage. Returns false if
+// the file cannot be opened or decoded; ctx then says where decoding stopped.
+bool run_pipeline(const char* filename, FILE* output, MemoryArena* arena, DecodeContext* ctx) {
+    FILE* input = fopen(filename, "rb");
+    if (input == 0) {
+        log_error("Failed to open file %s (%s)", filename, strerror(errno));
+        return false;
+    }
+
+    u64 size = file_size(input);
+    if (size > 0x7FFFFFFF) {
+        log_error("%s is %llu bytes; listings address at most 2 GB.", filename, (unsigned long long)size);
+        fclose(input);
+        return false;
+    }
+
+    // The rings' head and tail are cache line aligned.
+    Pipeline* p = new (arena_alloc(arena, sizeof(Pipeline), alignof(Pipeline))) Pipeline();
+    p->input = input;
+    p->output = output;
+    p->size = size;
+    p->first_bad_target = 0x7FFFFFFF;
+    init_decode_context(&p->decoder);
+
+    std::thread reader(read_stage, p);
+    std::thread decoder(decode_stage, p);
+    std::thread formatter(format_stage, p);
+    write_stage(p);
+
+    reader.join();
+    decoder.join();
+    formatter.join();
+    fclose(input);
+
+    *ctx = p->decoder;
+    return !p->failed;
+}
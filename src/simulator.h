@@ -0,0 +1,1082 @@
+#pragma once
+
+// 8086 execution.
+//
+// A Simulator owns a Machine (registers, flags and the 1 MB address space)
+// and runs it one decoded instruction at a time. The run loop is a template
+// over a hook policy, so debugging features cost nothing unless they are in
+// use:
+//
+//   BareHooks   no checks at all
+//   DebugHooks  breakpoints and write watchpoints
+//   FullHooks   the above plus tracing and profiling
+//
+// Every hook is a static inline function of the policy; the bare one returns
+// constants, so the compiler removes the checks from that copy of the loop.
+// run() picks the cheapest variant that covers the hooks currently set, and
+// adding or removing a hook switches variants at the next run().
+
+#include "decoder.h"
+
+#define MEMORY_SIZE        (1024 * 1024)
+#define MEMORY_ACCESS_MASK (MEMORY_SIZE - 1)
+
+// Breakpoints and watchpoints are one bit per physical address, so a check
+// is a single bit test however many are set.
+#define ADDRESS_BITMAP_WORDS (MEMORY_SIZE / 64)
+
+enum Flag {
+    FLAG_CF = 0x0001,
+    FLAG_PF = 0x0004,
+    FLAG_AF = 0x0010,
+    FLAG_ZF = 0x0040,
+    FLAG_SF = 0x0080,
+    FLAG_TF = 0x0100,
+    FLAG_IF = 0x0200,
+    FLAG_DF = 0x0400,
+    FLAG_OF = 0x0800,
+};
+
+// Bits popf can change; the rest read back as the 8086 leaves them.
+#define FLAGS_WRITABLE 0x0FD5
+#define FLAGS_FIXED    0xF002
+
+// Group one operations, in mod/rm reg field order.
+enum AluOp {
+    ALU_ADD = 0,
+    ALU_OR  = 1,
+    ALU_ADC = 2,
+    ALU_SBB = 3,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7,
+};
+
+enum StopReason {
+    STOP_NONE                    = 0,
+    STOP_HALT                    = 1,
+    STOP_END_OF_CODE             = 2,  // ip left the loaded image
+    STOP_INSTRUCTION_LIMIT       = 3,
+    STOP_BREAKPOINT              = 4,
+    STOP_WATCHPOINT              = 5,
+    STOP_INVALID_INSTRUCTION     = 6,
+    STOP_UNSUPPORTED_INSTRUCTION = 7,  // port I/O and the unused encodings
+    STOP_REASON_COUNT            = 8,
+};
+
+const char* stop_reason_names[STOP_REASON_COUNT] = {
+    "none",
+    "halt",
+    "end of code",
+    "instruction limit",
+    "breakpoint",
+    "watchpoint",
+    "invalid instruction",
+    "unsupported instruction",
+};
+
+struct Machine {
+    u16 registers[8];          // indexed by Register
+    u16 segment_registers[4];  // indexed by Segment
+    u16 ip;
+    u16 flags;
+    u8* memory;                // MEMORY_SIZE bytes
+};
+
+struct Simulator;
+struct MicroOpCache;
+
+typedef void (*TraceFunc) (void* user, Simulator* sim, DecodedInstruction* instruction);
+
+struct SimulatorHooks {
+    int breakpoint_count;
+    u64* breakpoints;                   // ADDRESS_BITMAP_WORDS, stop before executing
+
+    int watchpoint_count;
+    u64* watchpoints;                   // ADDRESS_BITMAP_WORDS, stop after a write
+
+    TraceFunc trace;                    // called after every instruction
+    void* trace_user;
+
+    u32* profile_counts;                // executions per physical address, or null
+};
+
+enum HookVariant {
+    HOOK_VARIANT_BARE  = 0,
+    HOOK_VARIANT_DEBUG = 1,
+    HOOK_VARIANT_FULL  = 2,
+};
+
+struct Simulator {
+    Machine machine;
+    DecodeContext decoder;
+
+    SimulatorHooks hooks;
+    HookVariant variant;
+
+    u32 code_end;              // physical address execution stops at
+    u64 instruction_count;
+
+    StopReason pending_stop;   // set by hooks in the middle of an instruction
+    u32 stop_address;          // what the last stop refers to: code, or the byte written
+    u32 stop_instruction;      // the instruction that was about to run or just ran
+
+    MicroOpCache* micro_ops;   // lowered code for run_lowered(), see micro_ops.h
+};
+
+void init_simulator(Simulator* sim, MemoryArena* arena) {
+    *sim = {};
+    sim->machine.memory = (u8*)arena_alloc(arena, MEMORY_SIZE);
+    memset(sim->machine.memory, 0, MEMORY_SIZE);
+
+    sim->hooks.breakpoints = (u64*)arena_alloc(arena, ADDRESS_BITMAP_WORDS * sizeof(u64));
+    sim->hooks.watchpoints = (u64*)arena_alloc(arena, ADDRESS_BITMAP_WORDS * sizeof(u64));
+    memset(sim->hooks.breakpoints, 0, ADDRESS_BITMAP_WORDS * sizeof(u64));
+    memset(sim->hooks.watchpoints, 0, ADDRESS_BITMAP_WORDS * sizeof(u64));
+    sim->code_end = MEMORY_SIZE;
+    init_decode_context(&sim->decoder);
+}
+
+// Copies an image to physical address 0, where execution starts.
+bool load_program(Simulator* sim, u8* bytes, size_t size) {
+    if (size > MEMORY_SIZE) {
+        log_error("program is %llu bytes, the 8086 only has %d.", (unsigned long long)size, MEMORY_SIZE);
+        return false;
+    }
+
+    memcpy(sim->machine.memory, bytes, size);
+    sim->code_end = (u32)size;
+    return true;
+}
+
+//
+// Hooks
+//
+
+void update_hook_variant(Simulator* sim) {
+    SimulatorHooks* hooks = &sim->hooks;
+    if (hooks->trace || hooks->profile_counts) {
+        sim->variant = HOOK_VARIANT_FULL;
+    } else if (hooks->breakpoint_count > 0 || hooks->watchpoint_count > 0) {
+        sim->variant = HOOK_VARIANT_DEBUG;
+    } else {
+        sim->variant = HOOK_VARIANT_BARE;
+    }
+}
+
+inline bool test_address(u64* bitmap, u32 address) {
+    return (bitmap[address >> 6] >> (address & 63)) & 1;
+}
+
+// Sets or clears an address bit and keeps count in step. Returns whether
+// the bit changed.
+inline bool set_address(u64* bitmap, int* count, u32 address, bool value) {
+    address &= MEMORY_ACCESS_MASK;
+    if (test_address(bitmap, address) == value) {
+        return false;
+    }
+
+    bitmap[address >> 6] ^= 1ull << (address & 63);
+    *count += value ? 1 : -1;
+    return true;
+}
+
+bool add_breakpoint(Simulator* sim, u32 address) {
+    bool added = set_address(sim->hooks.breakpoints, &sim->hooks.breakpoint_count, address, true);
+    update_hook_variant(sim);
+    return added;
+}
+
+bool remove_breakpoint(Simulator* sim, u32 address) {
+    bool removed = set_address(sim->hooks.breakpoints, &sim->hooks.breakpoint_count, address, false);
+    update_hook_variant(sim);
+    return removed;
+}
+
+bool add_watchpoint(Simulator* sim, u32 address) {
+    bool added = set_address(sim->hooks.watchpoints, &sim->hooks.watchpoint_count, address, true);
+    update_hook_variant(sim);
+    return added;
+}
+
+bool remove_watchpoint(Simulator* sim, u32 address) {
+    bool removed = set_address(sim->hooks.watchpoints, &sim->hooks.watchpoint_count, address, false);
+    update_hook_variant(sim);
+    return removed;
+}
+
+void set_trace(Simulator* sim, TraceFunc trace, void* user) {
+    sim->hooks.trace = trace;
+    sim->hooks.trace_user = user;
+    update_hook_variant(sim);
+}
+
+// Counts executions per physical address. Pass a null arena to stop.
+void enable_profile(Simulator* sim, MemoryArena* arena) {
+    if (arena) {
+        sim->hooks.profile_counts = (u32*)arena_alloc(arena, MEMORY_SIZE * sizeof(u32));
+        memset(sim->hooks.profile_counts, 0, MEMORY_SIZE * sizeof(u32));
+    } else {
+        sim->hooks.profile_counts = 0;
+    }
+    update_hook_variant(sim);
+}
+
+struct BareHooks {
+    static const bool watches = false;
+
+    static inline bool stop_before(Simulator*, u32) { return false; }
+    static inline void on_write(Simulator*, u32) {}
+    static inline void after(Simulator*, u32, DecodedInstruction*) {}
+};
+
+struct DebugHooks {
+    static const bool watches = true;
+
+    static inline bool stop_before(Simulator* sim, u32 address) {
+        return test_address(sim->hooks.breakpoints, address);
+    }
+
+    static inline void on_write(Simulator* sim, u32 address) {
+        if (test_address(sim->hooks.watchpoints, address) && sim->pending_stop == STOP_NONE) {
+            sim->pending_stop = STOP_WATCHPOINT;
+            sim->stop_address = address;
+        }
+    }
+
+    static inline void after(Simulator*, u32, DecodedInstruction*) {}
+};
+
+struct FullHooks {
+    static const bool watches = true;
+
+    static inline bool stop_before(Simulator* sim, u32 address) { return DebugHooks::stop_before(sim, address); }
+    static inline void on_write(Simulator* sim, u32 address) { DebugHooks::on_write(sim, address); }
+
+    static inline void after(Simulator* sim, u32 address, DecodedInstruction* instruction) {
+        if (sim->hooks.profile_counts) {
+            sim->hooks.profile_counts[address] += 1;
+        }
+        if (sim->hooks.trace) {
+            sim->hooks.trace(sim->hooks.trace_user, sim, instruction);
+        }
+    }
+};
+
+//
+// Machine state
+//
+
+inline u32 physical_address(Machine* m, u8 segment, u16 offset) {
+    return (((u32)m->segment_registers[segment] << 4) + offset) & MEMORY_ACCESS_MASK;
+}
+
+inline u16 read_register(Machine* m, u8 reg, bool word) {
+    if (word) {
+        return m->registers[reg];
+    }
+
+    u16 value = m->registers[reg & 0x03];
+    return (reg & 0x04) ? (value >> 8) : (value & 0xFF);
+}
+
+inline void write_register(Machine* m, u8 reg, u16 value, bool word) {
+    if (word) {
+        m->registers[reg] = value;
+        return;
+    }
+
+    u16* r = &m->registers[reg & 0x03];
+    if (reg & 0x04) {
+        *r = (*r & 0x00FF) | (u16)(value << 8);
+    } else {
+        *r = (*r & 0xFF00) | (value & 0xFF);
+    }
+}
+
+inline u16 read_memory(Machine* m, u32 address, bool word) {
+    u16 value = m->memory[address & MEMORY_ACCESS_MASK];
+    if (word) {
+        value |= m->memory[(address + 1) & MEMORY_ACCESS_MASK] << 8;
+    }
+    return value;
+}
+
+template <typename Hooks>
+inline void write_memory(Simulator* sim, u32 address, u16 value, bool word) {
+    u8* memory = sim->machine.memory;
+    memory[address & MEMORY_ACCESS_MASK] = (u8)value;
+    Hooks::on_write(sim, address & MEMORY_ACCESS_MASK);
+
+    if (word) {
+        memory[(address + 1) & MEMORY_ACCESS_MASK] = (u8)(value >> 8);
+        Hooks::on_write(sim, (address + 1) & MEMORY_ACCESS_MASK);
+    }
+}
+
+// The mod/rm operand of an instruction: a register or a physical address.
+struct Operand {
+    bool is_register;
+    u8 reg;
+    u32 address;
+};
+
+inline Operand rm_operand(Machine* m, DecodedInstruction* instruction) {
+    Operand operand = {};
+    if (instruction->rm_is_register) {
+        operand.is_register = true;
+        operand.reg = instruction->rm;
+    } else {
+        operand.address = effective_address_physical(&instruction->ea, m->registers, m->segment_registers);
+    }
+    return operand;
+}
+
+inline u16 read_operand(Machine* m, Operand* operand, bool word) {
+    return operand->is_register ? read_register(m, operand->reg, word) : read_memory(m, operand->address, word);
+}
+
+template <typename Hooks>
+inline void write_operand(Simulator* sim, Operand* operand, u16 value, bool word) {
+    if (operand->is_register) {
+        write_register(&sim->machine, operand->reg, value, word);
+    } else {
+        write_memory<Hooks>(sim, operand->address, value, word);
+    }
+}
+
+template <typename Hooks>
+inline void push(Simulator* sim, u16 value) {
+    Machine* m = &sim->machine;
+    m->registers[REGISTER_SP] -= 2;
+    write_memory<Hooks>(sim, physical_address(m, SEGMENT_SS, m->registers[REGISTER_SP]), value, true);
+}
+
+inline u16 pop(Machine* m) {
+    u16 value = read_memory(m, physical_address(m, SEGMENT_SS, m->registers[REGISTER_SP]), true);
+    m->registers[REGISTER_SP] += 2;
+    return value;
+}
+
+//
+// Arithmetic
+//
+
+inline void set_flag(Machine* m, u16 flag, bool value) {
+    if (value) {
+        m->flags |= flag;
+    } else {
+        m->flags &= ~flag;
+    }
+}
+
+inline bool get_flag(Machine* m, u16 flag) {
+    return (m->flags & flag) != 0;
+}
+
+// ZF, SF and PF from a result.
+inline void set_result_flags(Machine* m, u32 result, bool word) {
+    u32 mask = word ? 0xFFFF : 0xFF;
+    u32 sign = word ? 0x8000 : 0x80;
+    set_flag(m, FLAG_ZF, (result & mask) == 0);
+    set_flag(m, FLAG_SF, (result & sign) != 0);
+    set_flag(m, FLAG_PF, (count_bits(result & 0xFF) & 1) == 0);
+}
+
+// Runs a group one operation and sets every arithmetic flag. cmp returns the
+// difference like sub; the caller decides whether to store it.
+u16 alu(Machine* m, u8 op, u16 left, u16 right, bool word) {
+    u32 mask = word ? 0xFFFF : 0xFF;
+    u32 sign = word ? 0x8000 : 0x80;
+    u32 a = left & mask;
+    u32 b = right & mask;
+    u32 carry = get_flag(m, FLAG_CF) ? 1 : 0;
+    u32 result = 0;
+
+    // add and sub are adc and sbb without the carry in.
+    if (op == ALU_ADD || op == ALU_SUB || op == ALU_CMP) {
+        carry = 0;
+    }
+
+    switch (op) {
+        case ALU_ADD:
+        case ALU_ADC: {
+            result = a + b + carry;
+            set_flag(m, FLAG_CF, result > mask);
+            set_flag(m, FLAG_OF, ((a ^ result) & (b ^ result) & sign) != 0);
+            set_flag(m, FLAG_AF, ((a ^ b ^ result) & 0x10) != 0);
+        } break;
+
+        case ALU_SUB:
+        case ALU_CMP:
+        case ALU_SBB: {
+            result = a - b - carry;
+            set_flag(m, FLAG_CF, a < b + carry);
+            set_flag(m, FLAG_OF, ((a ^ b) & (a ^ result) & sign) != 0);
+            set_flag(m, FLAG_AF, ((a ^ b ^ result) & 0x10) != 0);
+        } break;
+
+        case ALU_OR:
+        case ALU_AND:
+        case ALU_XOR: {
+            result = (op == ALU_OR) ? (a | b) : (op == ALU_AND) ? (a & b) : (a ^ b);
+            m->flags &= ~(FLAG_CF | FLAG_OF | FLAG_AF);
+        } break;
+    }
+
+    set_result_flags(m, result, word);
+    return (u16)(result & mask);
+}
+
+// inc and dec leave CF alone.
+inline u16 step_value(Machine* m, u16 value, bool word, bool increment) {
+    u16 carry = m->flags & FLAG_CF;
+    u16 result = alu(m, increment ? ALU_ADD : ALU_SUB, value, 1, word);
+    m->flags = (m->flags & ~FLAG_CF) | carry;
+    return result;
+}
+
+// Rotates and shifts, in mod/rm reg field order. The count is not masked on
+// the 8086, so cl can shift up to 255 times.
+u16 shift(Machine* m, u8 op, u16 value, u8 count, bool word) {
+    if (count == 0) {
+        return value;
+    }
+
+    u32 mask = word ? 0xFFFF : 0xFF;
+    u32 sign = word ? 0x8000 : 0x80;
+    u32 result = value & mask;
+    u32 before = result;
+    bool carry = get_flag(m, FLAG_CF);
+
+    for (int i = 0; i < count; i++) {
+        before = result;
+        switch (op) {
+            case 0: { // rol
+                carry = (result & sign) != 0;
+                result = ((result << 1) | (carry ? 1 : 0)) & mask;
+            } break;
+            case 1: { // ror
+                carry = (result & 1) != 0;
+                result = (result >> 1) | (carry ? sign : 0);
+            } break;
+            case 2: { // rcl
+                bool out = (result & sign) != 0;
+                result = ((result << 1) | (carry ? 1 : 0)) & mask;
+                carry = out;
+            } break;
+            case 3: { // rcr
+                bool out = (result & 1) != 0;
+                result = (result >> 1) | (carry ? sign : 0);
+                carry = out;
+            } break;
+            case 4:
+            case 6: { // shl, sal
+                carry = (result & sign) != 0;
+                result = (result << 1) & mask;
+            } break;
+            case 5: { // shr
+                carry = (result & 1) != 0;
+                result >>= 1;
+            } break;
+            case 7: { // sar
+                carry = (result & 1) != 0;
+                result = (result >> 1) | (result & sign);
+            } break;
+        }
+    }
+
+    set_flag(m, FLAG_CF, carry);
+
+    // OF is only defined for single bit shifts; this is what they produce.
+    bool msb = (result & sign) != 0;
+    switch (op) {
+        case 0: case 2: case 4: case 6: set_flag(m, FLAG_OF, msb != carry); break;
+        case 1: case 3: set_flag(m, FLAG_OF, msb != ((result & (sign >> 1)) != 0)); break;
+        case 5: set_flag(m, FLAG_OF, (before & sign) != 0); break;
+        case 7: set_flag(m, FLAG_OF, false); break;
+    }
+
+    if (op >= 4) {
+        set_result_flags(m, result, word);
+    }
+
+    return (u16)result;
+}
+
+// Conditions for the 0x70-0x7F jumps; odd codes are the negations.
+inline bool condition(u16 flags, u8 code) {
+    bool cf = (flags & FLAG_CF) != 0;
+    bool zf = (flags & FLAG_ZF) != 0;
+    bool sf = (flags & FLAG_SF) != 0;
+    bool of = (flags & FLAG_OF) != 0;
+    bool pf = (flags & FLAG_PF) != 0;
+
+    bool result = false;
+    switch (code >> 1) {
+        case 0: result = of;               break; // jo
+        case 1: result = cf;               break; // jb
+        case 2: result = zf;               break; // je
+        case 3: result = cf || zf;         break; // jbe
+        case 4: result = sf;               break; // js
+        case 5: result = pf;               break; // jp
+        case 6: result = sf != of;         break; // jl
+        case 7: result = zf || (sf != of); break; // jle
+    }
+    return result != ((code & 1) != 0);
+}
+
+template <typename Hooks>
+void interrupt(Simulator* sim, u8 vector) {
+    Machine* m = &sim->machine;
+    push<Hooks>(sim, m->flags | FLAGS_FIXED);
+    m->flags &= ~(FLAG_IF | FLAG_TF);
+    push<Hooks>(sim, m->segment_registers[SEGMENT_CS]);
+    push<Hooks>(sim, m->ip);
+    m->ip = read_memory(m, vector * 4, true);
+    m->segment_registers[SEGMENT_CS] = read_memory(m, vector * 4 + 2, true);
+}
+
+template <typename Hooks>
+void multiply_divide(Simulator* sim, u8 op, u16 value, bool word) {
+    Machine* m = &sim->machine;
+    u16* r = m->registers;
+
+    switch (op) {
+        case 4: { // mul
+            if (word) {
+                u32 result = (u32)r[REGISTER_AX] * value;
+                r[REGISTER_AX] = (u16)result;
+                r[REGISTER_DX] = (u16)(result >> 16);
+                set_flag(m, FLAG_CF | FLAG_OF, r[REGISTER_DX] != 0);
+            } else {
+                r[REGISTER_AX] = (u16)((r[REGISTER_AX] & 0xFF) * value);
+                set_flag(m, FLAG_CF | FLAG_OF, (r[REGISTER_AX] >> 8) != 0);
+            }
+        } break;
+
+        case 5: { // imul
+            if (word) {
+                int result = (int)(short)r[REGISTER_AX] * (short)value;
+                r[REGISTER_AX] = (u16)result;
+                r[REGISTER_DX] = (u16)((u32)result >> 16);
+                set_flag(m, FLAG_CF | FLAG_OF, result != (short)result);
+            } else {
+                int result = (int)(char)r[REGISTER_AX] * (char)value;
+                r[REGISTER_AX] = (u16)result;
+                set_flag(m, FLAG_CF | FLAG_OF, result != (char)result);
+            }
+        } break;
+
+        case 6: { // div
+            if (word) {
+                u32 dividend = ((u32)r[REGISTER_DX] << 16) | r[REGISTER_AX];
+                if (value == 0 || dividend / value > 0xFFFF) {
+                    interrupt<Hooks>(sim, 0);
+                    return;
+                }
+                r[REGISTER_AX] = (u16)(dividend / value);
+                r[REGISTER_DX] = (u16)(dividend % value);
+            } else {
+                u16 dividend = r[REGISTER_AX];
+                if (value == 0 || dividend / value > 0xFF) {
+                    interrupt<Hooks>(sim, 0);
+                    return;
+                }
+                r[REGISTER_AX] = (u16)((dividend / value) | ((dividend % value) << 8));
+            }
+        } break;
+
+        case 7: { // idiv
+            if (word) {
+                long long dividend = (int)(((u32)r[REGISTER_DX] << 16) | r[REGISTER_AX]);
+                long long divisor = (short)value;
+                if (divisor == 0 || dividend / divisor > 0x7FFF || dividend / divisor < -0x7FFF) {
+                    interrupt<Hooks>(sim, 0);
+                    return;
+                }
+                r[REGISTER_AX] = (u16)(dividend / divisor);
+                r[REGISTER_DX] = (u16)(dividend % divisor);
+            } else {
+                int dividend = (short)r[REGISTER_AX];
+                int divisor = (char)value;
+                if (divisor == 0 || dividend / divisor > 0x7F || dividend / divisor < -0x7F) {
+                    interrupt<Hooks>(sim, 0);
+                    return;
+                }
+                r[REGISTER_AX] = (u16)(((dividend / divisor) & 0xFF) | (((dividend % divisor) & 0xFF) << 8));
+            }
+        } break;
+    }
+}
+
+// daa, das, aaa and aas.
+void decimal_adjust(Machine* m, u8 op) {
+    u16* r = m->registers;
+    u8 al = (u8)r[REGISTER_AX];
+    bool carry = get_flag(m, FLAG_CF);
+    bool low_adjust = (al & 0x0F) > 9 || get_flag(m, FLAG_AF);
+
+    switch (op) {
+        case 0x27:
+        case 0x2F: { // daa, das
+            bool subtract = op == 0x2F;
+            u8 result = al;
+            bool new_carry = false;
+            if (low_adjust) {
+                result = subtract ? result - 6 : result + 6;
+                new_carry = carry || (subtract ? al < 6 : al > 0xF9);
+            }
+            if (al > 0x99 || carry) {
+                result = subtract ? result - 0x60 : result + 0x60;
+                new_carry = true;
+            }
+            set_flag(m, FLAG_AF, low_adjust);
+            set_flag(m, FLAG_CF, new_carry);
+            set_result_flags(m, result, false);
+            write_register(m, REGISTER_AX, result, false);
+        } break;
+
+        case 0x37:
+        case 0x3F: { // aaa, aas
+            if (low_adjust) {
+                if (op == 0x37) {
+                    r[REGISTER_AX] = (u16)(((r[REGISTER_AX] + 0x100) & 0xFF00) | ((al + 6) & 0x0F));
+                } else {
+                    r[REGISTER_AX] = (u16)(((r[REGISTER_AX] - 0x100) & 0xFF00) | ((al - 6) & 0x0F));
+                }
+            } else {
+                r[REGISTER_AX] &= 0xFF0F;
+            }
+            set_flag(m, FLAG_AF | FLAG_CF, low_adjust);
+        } break;
+    }
+}
+
+//
+// Execution
+//
+
+// Executes one instruction whose bytes start at physical address fetch. ip
+// already points past it. Returns STOP_NONE to keep going; an unsupported
+// instruction changes nothing.
+template <typename Hooks>
+StopReason execute(Simulator* sim, DecodedInstruction* instruction, u32 fetch) {
+    Machine* m = &sim->machine;
+    u16* r = m->registers;
+    u16* s = m->segment_registers;
+    u8 op = instruction->opcode;
+    u8 reg = instruction->reg;
+    bool word = instruction->word;
+
+    switch (instruction->op_class) {
+        case OP_CLASS_REGISTER_MEMORY_AND_REGISTER: {
+            Operand rm = rm_operand(m, instruction);
+
+            if (op <= 0x3F) {
+                u8 alu_op = (op >> 3) & 0x07;
+                if (instruction->dir) {
+                    u16 result = alu(m, alu_op, read_register(m, reg, word), read_operand(m, &rm, word), word);
+                    if (alu_op != ALU_CMP) {
+                        write_register(m, reg, result, word);
+                    }
+                } else {
+                    u16 result = alu(m, alu_op, read_operand(m, &rm, word), read_register(m, reg, word), word);
+                    if (alu_op != ALU_CMP) {
+                        write_operand<Hooks>(sim, &rm, result, word);
+                    }
+                }
+            } else if (op == 0x84 || op == 0x85) {         // test
+                alu(m, ALU_AND, read_operand(m, &rm, word), read_register(m, reg, word), word);
+            } else if (op == 0x86 || op == 0x87) {         // xchg
+                u16 value = read_operand(m, &rm, word);
+                write_operand<Hooks>(sim, &rm, read_register(m, reg, word), word);
+                write_register(m, reg, value, word);
+            } else if (op >= 0x88 && op <= 0x8B) {         // mov
+                if (instruction->dir) {
+                    write_register(m, reg, read_operand(m, &rm, word), word);
+                } else {
+                    write_operand<Hooks>(sim, &rm, read_register(m, reg, word), word);
+                }
+            } else if (op == 0x8D) {                       // lea
+                if (rm.is_register) {
+                    return STOP_UNSUPPORTED_INSTRUCTION;
+                }
+                r[reg] = effective_address_offset(&instruction->ea, r);
+            } else if (op == 0xC4 || op == 0xC5) {         // les, lds
+                if (rm.is_register) {
+                    return STOP_UNSUPPORTED_INSTRUCTION;
+                }
+                r[reg] = read_memory(m, rm.address, true);
+                s[op == 0xC4 ? SEGMENT_ES : SEGMENT_DS] = read_memory(m, rm.address + 2, true);
+            }
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER_MEMORY: {
+            Operand rm = rm_operand(m, instruction);
+            u16 data = instruction->data;
+
+            if (op == 0xC6 || op == 0xC7) {                // mov
+                write_operand<Hooks>(sim, &rm, data, word);
+            } else if (op == 0xF6 || op == 0xF7) {         // test
+                alu(m, ALU_AND, read_operand(m, &rm, word), data, word);
+            } else {
+                u16 result = alu(m, reg, read_operand(m, &rm, word), data, word);
+                if (reg != ALU_CMP) {
+                    write_operand<Hooks>(sim, &rm, result, word);
+                }
+            }
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_ACCUMULATOR: {
+            u16 data = instruction->data;
+
+            if (op <= 0x3F) {
+                u8 alu_op = (op >> 3) & 0x07;
+                u16 result = alu(m, alu_op, read_register(m, REGISTER_AX, word), data, word);
+                if (alu_op != ALU_CMP) {
+                    write_register(m, REGISTER_AX, result, word);
+                }
+            } else if (op == 0xA8 || op == 0xA9) {         // test
+                alu(m, ALU_AND, read_register(m, REGISTER_AX, word), data, word);
+            } else {                                       // in, out
+                return STOP_UNSUPPORTED_INSTRUCTION;
+            }
+        } break;
+
+        case OP_CLASS_REGISTER: {
+            switch (op & 0xF8) {
+                case 0x40: r[reg] = step_value(m, r[reg], true, true);  break;
+                case 0x48: r[reg] = step_value(m, r[reg], true, false); break;
+                case 0x50: push<Hooks>(sim, reg == REGISTER_SP ? r[reg] - 2 : r[reg]); break;
+                case 0x58: r[reg] = pop(m); break;
+            }
+        } break;
+
+        case OP_CLASS_SEGMENT: {
+            if (op & 0x01) {
+                s[reg] = pop(m);
+            } else {
+                push<Hooks>(sim, s[reg]);
+            }
+        } break;
+
+        case OP_CLASS_ACCUMULATOR_REGISTER: {
+            u16 value = r[REGISTER_AX];
+            r[REGISTER_AX] = r[reg];
+            r[reg] = value;
+        } break;
+
+        case OP_CLASS_IMMEDIATE_TO_REGISTER: {
+            write_register(m, reg, instruction->data, word);
+        } break;
+
+        case OP_CLASS_ACCUMULATOR_MEMORY: {
+            u8 segment = instruction->has_segment_override ? instruction->segment_override : (u8)SEGMENT_DS;
+            u32 address = physical_address(m, segment, instruction->data);
+            if (instruction->dir) {
+                write_memory<Hooks>(sim, address, r[REGISTER_AX], word);
+            } else {
+                write_register(m, REGISTER_AX, read_memory(m, address, word), word);
+            }
+        } break;
+
+        case OP_CLASS_SEG_REG: {
+            Operand rm = rm_operand(m, instruction);
+            if (op == 0x8C) {
+                write_operand<Hooks>(sim, &rm, s[reg], true);
+            } else {
+                s[reg] = read_operand(m, &rm, true);
+            }
+        } break;
+
+        case OP_CLASS_REGISTER_MEMORY: {
+            Operand rm = rm_operand(m, instruction);
+
+            if (op == 0x8F) {                              // pop
+                write_operand<Hooks>(sim, &rm, pop(m), true);
+            } else if (instruction->is_bit_shift) {
+                u8 count = instruction->shift_by_cl ? (u8)r[REGISTER_CX] : 1;
+                write_operand<Hooks>(sim, &rm, shift(m, reg, read_operand(m, &rm, word), count, word), word);
+            } else if (op == 0xF6 || op == 0xF7) {
+                u16 value = read_operand(m, &rm, word);
+                switch (reg) {
+                    case 2: write_operand<Hooks>(sim, &rm, ~value, word); break;          // not
+                    case 3: {                                                             // neg
+                        write_operand<Hooks>(sim, &rm, alu(m, ALU_SUB, 0, value, word), word);
+                        set_flag(m, FLAG_CF, (value & (word ? 0xFFFF : 0xFF)) != 0);
+                    } break;
+                    case 4: case 5: case 6: case 7: multiply_divide<Hooks>(sim, reg, value, word); break;
+                    default: return STOP_UNSUPPORTED_INSTRUCTION;
+                }
+            } else if (reg <= 1) {                         // inc, dec
+                write_operand<Hooks>(sim, &rm, step_value(m, read_operand(m, &rm, word), word, reg == 0), word);
+            } else if (op == 0xFF && reg != 7) {
+                bool far = reg == 3 || reg == 5;
+                if (far && rm.is_register) {
+                    return STOP_UNSUPPORTED_INSTRUCTION;
+                }
+
+                u16 target = read_operand(m, &rm, true);
+                switch (reg) {
+                    case 2: push<Hooks>(sim, m->ip); m->ip = target; break;              // call
+                    case 3: {                                                            // call far
+                        push<Hooks>(sim, s[SEGMENT_CS]);
+                        push<Hooks>(sim, m->ip);
+                        s[SEGMENT_CS] = read_memory(m, rm.address + 2, true);
+                        m->ip = target;
+                    } break;
+                    case 4: m->ip = target; break;                                       // jmp
+                    case 5: {                                                            // jmp far
+                        s[SEGMENT_CS] = read_memory(m, rm.address + 2, true);
+                        m->ip = target;
+                    } break;
+                    case 6: push<Hooks>(sim, (rm.is_register && rm.reg == REGISTER_SP) ? target - 2 : target); break; // push
+                }
+            } else {
+                return STOP_UNSUPPORTED_INSTRUCTION;
+            }
+        } break;
+
+        case OP_CLASS_STRING: {
+            int size = word ? 2 : 1;
+            int delta = get_flag(m, FLAG_DF) ? -size : size;
+            u8 source_segment = instruction->has_segment_override ? instruction->segment_override : (u8)SEGMENT_DS;
+            u8 kind = op & 0xFE;
+            bool compares = kind == 0xA6 || kind == 0xAE;
+
+            while (!instruction->rep || r[REGISTER_CX] != 0) {
+                u32 source = physical_address(m, source_segment, r[REGISTER_SI]);
+                u32 destination = physical_address(m, SEGMENT_ES, r[REGISTER_DI]);
+
+                switch (kind) {
+                    case 0xA4: { // movs
+                        write_memory<Hooks>(sim, destination, read_memory(m, source, word), word);
+                        r[REGISTER_SI] += delta;
+                        r[REGISTER_DI] += delta;
+                    } break;
+                    case 0xA6: { // cmps
+                        alu(m, ALU_CMP, read_memory(m, source, word), read_memory(m, destination, word), word);
+                        r[REGISTER_SI] += delta;
+                        r[REGISTER_DI] += delta;
+                    } break;
+                    case 0xAA: { // stos
+                        write_memory<Hooks>(sim, destination, r[REGISTER_AX], word);
+                        r[REGISTER_DI] += delta;
+                    } break;
+                    case 0xAC: { // lods
+                        write_register(m, REGISTER_AX, read_memory(m, source, word), word);
+                        r[REGISTER_SI] += delta;
+                    } break;
+                    case 0xAE: { // scas
+                        alu(m, ALU_CMP, read_register(m, REGISTER_AX, word), read_memory(m, destination, word), word);
+                        r[REGISTER_DI] += delta;
+                    } break;
+                }
+
+                if (!instruction->rep) {
+                    break;
+                }
+
+                // F3 is rep for movs/stos/lods and repe for cmps/scas.
+                r[REGISTER_CX] -= 1;
+                if (compares && !get_flag(m, FLAG_ZF)) {
+                    break;
+                }
+            }
+        } break;
+
+        case OP_CLASS_JUMP: {
+            bool taken = false;
+            if (op < 0x80) {
+                taken = condition(m->flags, op & 0x0F);
+            } else if (op == 0xE3) {                       // jcxz
+                taken = r[REGISTER_CX] == 0;
+            } else {
+                r[REGISTER_CX] -= 1;
+                taken = r[REGISTER_CX] != 0;
+                if (op == 0xE0) taken = taken && !get_flag(m, FLAG_ZF); // loopnz
+                if (op == 0xE1) taken = taken && get_flag(m, FLAG_ZF);  // loopz
+            }
+
+            if (taken) {
+                m->ip = (u16)instruction->target;
+            }
+        } break;
+
+        case OP_CLASS_NEAR_RELATIVE: {
+            if (op == 0xE8) {
+                push<Hooks>(sim, m->ip);
+            }
+            m->ip = (u16)instruction->target;
+        } break;
+
+        case OP_CLASS_SHORT_RELATIVE: {
+            m->ip = (u16)instruction->target;
+        } break;
+
+        case OP_CLASS_FAR_POINTER: {
+            if (op == 0x9A) {
+                push<Hooks>(sim, s[SEGMENT_CS]);
+                push<Hooks>(sim, m->ip);
+            }
+            s[SEGMENT_CS] = instruction->segment;
+            m->ip = instruction->data;
+        } break;
+
+        case OP_CLASS_IMMEDIATE: {
+            if (op == 0xCD) {                              // int
+                interrupt<Hooks>(sim, (u8)instruction->data);
+            } else {                                       // ret, retf with a pop count
+                m->ip = pop(m);
+                if (op == 0xCA) {
+                    s[SEGMENT_CS] = pop(m);
+                }
+                r[REGISTER_SP] += instruction->data;
+            }
+        } break;
+
+        case OP_CLASS_ACCUMULATOR_DX: {
+            return STOP_UNSUPPORTED_INSTRUCTION;
+        } break;
+
+        case OP_CLASS_NONE: {
+            switch (op) {
+                case 0x27: case 0x2F: case 0x37: case 0x3F: decimal_adjust(m, op); break;
+                case 0x98: r[REGISTER_AX] = (u16)(short)(char)r[REGISTER_AX]; break;                  // cbw
+                case 0x99: r[REGISTER_DX] = (r[REGISTER_AX] & 0x8000) ? 0xFFFF : 0; break;           // cwd
+                case 0x9B: break;                                                                     // wait
+                case 0x9C: push<Hooks>(sim, m->flags | FLAGS_FIXED); break;                           // pushf
+                case 0x9D: m->flags = pop(m) & FLAGS_WRITABLE; break;                                 // popf
+                case 0x9E: m->flags = (m->flags & 0xFF00) | ((r[REGISTER_AX] >> 8) & 0xD5); break;   // sahf
+                case 0x9F: write_register(m, 4, (m->flags | FLAGS_FIXED) & 0xFF, false); break;      // lahf
+                case 0xC3: m->ip = pop(m); break;                                                     // ret
+                case 0xCB: m->ip = pop(m); s[SEGMENT_CS] = pop(m); break;                            // retf
+                case 0xCC: interrupt<Hooks>(sim, 3); break;                                           // int3
+                case 0xCE: if (get_flag(m, FLAG_OF)) interrupt<Hooks>(sim, 4); break;                // into
+                case 0xCF: {                                                                          // iret
+                    m->ip = pop(m);
+                    s[SEGMENT_CS] = pop(m);
+                    m->flags = pop(m) & FLAGS_WRITABLE;
+                } break;
+                case 0xD4: {                                                                          // aam
+                    u8 base = m->memory[(fetch + instruction->length - 1) & MEMORY_ACCESS_MASK];
+                    if (base == 0) {
+                        interrupt<Hooks>(sim, 0);
+                        break;
+                    }
+                    u8 al = (u8)r[REGISTER_AX];
+                    r[REGISTER_AX] = (u16)(((al / base) << 8) | (al % base));
+                    set_result_flags(m, r[REGISTER_AX], false);
+                } break;
+                case 0xD5: {                                                                          // aad
+                    u8 base = m->memory[(fetch + instruction->length - 1) & MEMORY_ACCESS_MASK];
+                    r[REGISTER_AX] = (u16)((r[REGISTER_AX] + (r[REGISTER_AX] >> 8) * base) & 0xFF);
+                    set_result_flags(m, r[REGISTER_AX], false);
+                } break;
+                case 0xD7: {                                                                          // xlat
+                    u8 segment = instruction->has_segment_override ? instruction->segment_override : (u8)SEGMENT_DS;
+                    u16 offset = r[REGISTER_BX] + (r[REGISTER_AX] & 0xFF);
+                    write_register(m, REGISTER_AX, read_memory(m, physical_address(m, segment, offset), false), false);
+                } break;
+                case 0xF4: return STOP_HALT;                                                          // hlt
+                case 0xF5: m->flags ^= FLAG_CF; break;                                                // cmc
+                case 0xF8: set_flag(m, FLAG_CF, false); break;
+                case 0xF9: set_flag(m, FLAG_CF, true);  break;
+                case 0xFA: set_flag(m, FLAG_IF, false); break;
+                case 0xFB: set_flag(m, FLAG_IF, true);  break;
+                case 0xFC: set_flag(m, FLAG_DF, false); break;
+                case 0xFD: set_flag(m, FLAG_DF, true);  break;
+                default: return STOP_UNSUPPORTED_INSTRUCTION;
+            }
+        } break;
+    }
+
+    return STOP_NONE;
+}
+
+inline StopReason stop(Simulator* sim, StopReason reason, u32 address) {
+    sim->stop_address = address;
+    sim->stop_instruction = address;
+    return reason;
+}
+
+// Runs up to max_instructions. A breakpoint on the first instruction is
+// ignored so that running again continues past it.
+template <typename Hooks>
+StopReason run_loop(Simulator* sim, u64 max_instructions) {
+    Machine* m = &sim->machine;
+    sim->pending_stop = STOP_NONE;
+
+    for (u64 n = 0; n < max_instructions; n++) {
+        u32 address = physical_address(m, SEGMENT_CS, m->ip);
+        if (address >= sim->code_end) {
+            return stop(sim, STOP_END_OF_CODE, address);
+        }
+
+        if (n > 0 && Hooks::stop_before(sim, address)) {
+            return stop(sim, STOP_BREAKPOINT, address);
+        }
+
+        DecodedInstruction instruction;
+        int length = decode_one(&sim->decoder, &m->memory[address], MEMORY_SIZE - address, m->ip, &instruction);
+        if (length == 0) {
+            return stop(sim, STOP_INVALID_INSTRUCTION, address);
+        }
+
+        u16 ip = m->ip;
+        m->ip += length;
+
+        StopReason reason = execute<Hooks>(sim, &instruction, address);
+        if (reason == STOP_UNSUPPORTED_INSTRUCTION) {
+            m->ip = ip;
+            return stop(sim, reason, address);
+        }
+
+        sim->instruction_count += 1;
+        Hooks::after(sim, address, &instruction);
+
+        if (reason != STOP_NONE) {
+            return stop(sim, reason, address);
+        }
+
+        if (Hooks::watches && sim->pending_stop != STOP_NONE) {
+            sim->stop_instruction = address;
+            return sim->pending_stop;
+        }
+    }
+
+    return stop(sim, STOP_INSTRUCTION_LIMIT, physical_address(m, SEGMENT_CS, m->ip));
+}
+
+StopReason run(Simulator* sim, u64 max_instructions = ~0ull) {
+    switch (sim->variant) {
+        case HOOK_VARIANT_BARE:        return run_loop<BareHooks>(sim, max_instructions);
+        case HOOK_VARIANT_DEBUG:       return run_loop<DebugHooks>(sim, max_instructions);
+        case HOOK_VARIANT_FULL:        return run_loop<FullHooks>(sim, max_instructions);
+    }
+    return STOP_NONE;
+}
+
+void print_machine(Simulator* sim, FILE* stream = stdout) {
+    Machine* m = &sim->machine;
+
+    for (int i = 0; i < 8; i++) {
+        fprintf(stream, "%s: 0x%04x (%u)\n", register_map_word[i].text, m->registers[i], m->registers[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        fprintf(stream, "%s: 0x%04x (%u)\n", segments[i].text, m->segment_registers[i], m->segment_registers[i]);
+    }
+    fprintf(stream, "ip: 0x%04x (%u)\n", m->ip, m->ip);
+
+    const char names[] = "CPAZSTIDO";
+    const u16 bits[] = { FLAG_CF, FLAG_PF, FLAG_AF, FLAG_ZF, FLAG_SF, FLAG_TF, FLAG_IF, FLAG_DF, FLAG_OF };
+    fprintf(stream, "flags: ");
+    for (int i = 0; i < 9; i++) {
+        if (m->flags & bits[i]) {
+            fputc(names[i], stream);
+        }
+    }
+    fputc('\n', stream);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+// Where decode() sends instructions.
+//
+// Sinks are picked at compile time: decode<Sink>() calls Sink::emit()
+// directly, so it inlines into the decode loop. The null and count sinks
+// never render or touch the arena and run at the decoder's own speed.
+//
+//   TextSink    fills the InstructionStore the listing is rendered from
+//   NullSink    drops everything, for validation and benchmarks
+//   BinarySink  writes one fixed-size BinaryRecord per instruction
+//   CountSink   counts instructions, bytes and op classes
+
+#include "decoder.h"
+#include "format.h"
+#include "instruction_store.h"
+#include "stats.h"
+
+#ifdef _MSC_VER
+    #include <fcntl.h>
+    #include <io.h>
+#endif
+
+enum SinkKind {
+    SINK_TEXT   = 0,
+    SINK_NULL   = 1,
+    SINK_BINARY = 2,
+    SINK_COUNTS = 3,
+};
+
+struct TextSink {
+    InstructionStore* store;
+
+    static inline void emit(TextSink* sink, DecodedInstruction* instruction) {
+        InstructionStore* store = sink->store;
+        STATS_COUNT_OP_CLASS(instruction->op_class);
+
+        // Only the length is kept; emit_listing() renders the line again
+        // straight into its place in the output.
+        char text[MAX_INSTRUCTION_TEXT];
+        int text_length = render_instruction(instruction, text);
+        int index = push_instruction(store, instruction->address, (u8)text_length);
+
+        if (instruction->op_class == OP_CLASS_JUMP) {
+            push_jump(store, index, instruction->target);
+        }
+    }
+};
+
+struct NullSink {
+    static inline void emit(NullSink*, DecodedInstruction*) {}
+};
+
+// BinaryRecord flags
+#define BINARY_RECORD_LOCK             0x0001
+#define BINARY_RECORD_REP              0x0002
+#define BINARY_RECORD_WORD             0x0004
+#define BINARY_RECORD_DATA_WORD        0x0008
+#define BINARY_RECORD_DIR              0x0010
+#define BINARY_RECORD_RM_IS_REGISTER   0x0020
+#define BINARY_RECORD_SEGMENT_OVERRIDE 0x0040
+#define BINARY_RECORD_BIT_SHIFT        0x0080
+#define BINARY_RECORD_SHIFT_BY_CL      0x0100
+#define BINARY_RECORD_MEMORY           0x0200  // has a memory operand
+#define BINARY_RECORD_DIRECT           0x0400  // the memory operand is [disp16]
+
+// Written in host byte order, so little-endian on x86. The mnemonic is not
+// stored; opcode and reg identify it.
+struct BinaryRecord {
+    u32 address;
+    int target;           // jump or call target
+    u16 data;             // immediate, direct address or far offset
+    u16 segment;          // far pointer segment
+    short displacement;   // memory operand displacement
+    u8 length;
+    u8 opcode;
+    u8 op_class;
+    u8 operands;          // reg in bits 0-2, rm in bits 3-5, override segment in bits 6-7
+    u16 flags;
+};
+
+static_assert(sizeof(BinaryRecord) == 20, "BinaryRecord is a file format");
+
+#define BINARY_SINK_BUFFER 4096
+
+struct BinarySink {
+    FILE* stream;
+    int count;
+    BinaryRecord records[BINARY_SINK_BUFFER];
+
+    static inline void emit(BinarySink* sink, DecodedInstruction* instruction);
+};
+
+void init_binary_sink(BinarySink* sink, FILE* stream) {
+    sink->stream = stream;
+    sink->count = 0;
+
+#ifdef _MSC_VER
+    // Records are raw bytes; keep the CRT from turning \n into \r\n.
+    _setmode(_fileno(stream), _O_BINARY);
+#endif
+}
+
+void flush_binary_sink(BinarySink* sink) {
+    fwrite(sink->records, sizeof(BinaryRecord), sink->count, sink->stream);
+    sink->count = 0;
+}
+
+inline void BinarySink::emit(BinarySink* sink, DecodedInstruction* instruction) {
+    BinaryRecord* record = &sink->records[sink->count];
+
+    bool memory = !instruction->rm_is_register && instruction->ea.form;
+    u8 rm = instruction->rm_is_register ? instruction->rm : instruction->ea.rm;
+
+    u16 flags = 0;
+    if (instruction->lock)                 flags |= BINARY_RECORD_LOCK;
+    if (instruction->rep)                  flags |= BINARY_RECORD_REP;
+    if (instruction->word)                 flags |= BINARY_RECORD_WORD;
+    if (instruction->data_word)            flags |= BINARY_RECORD_DATA_WORD;
+    if (instruction->dir)                  flags |= BINARY_RECORD_DIR;
+    if (instruction->rm_is_register)       flags |= BINARY_RECORD_RM_IS_REGISTER;
+    if (instruction->has_segment_override) flags |= BINARY_RECORD_SEGMENT_OVERRIDE;
+    if (instruction->is_bit_shift)         flags |= BINARY_RECORD_BIT_SHIFT;
+    if (instruction->shift_by_cl)          flags |= BINARY_RECORD_SHIFT_BY_CL;
+    if (memory)                            flags |= BINARY_RECORD_MEMORY;
+    if (memory && !instruction->ea.form->uses_registers) flags |= BINARY_RECORD_DIRECT;
+
+    record->address      = (u32)instruction->address;
+    record->target       = instruction->target;
+    record->data         = instruction->data;
+    record->segment      = instruction->segment;
+    record->displacement = memory ? instruction->ea.displacement : 0;
+    record->length       = instruction->length;
+    record->opcode       = instruction->opcode;
+    record->op_class     = (u8)instruction->op_class;
+    record->operands     = (u8)((instruction->reg & 7) | ((rm & 7) << 3) | ((instruction->segment_override & 3) << 6));
+    record->flags        = flags;
+
+    sink->count += 1;
+    if (sink->count == BINARY_SINK_BUFFER) {
+        flush_binary_sink(sink);
+    }
+}
+
+struct CountSink {
+    u64 instructions;
+    u64 bytes;
+    u64 jumps;
+    u64 op_class_counts[OP_CLASS_COUNT];
+
+    static inline void emit(CountSink* sink, DecodedInstruction* instruction) {
+        sink->instructions += 1;
+        sink->bytes += instruction->length;
+        sink->jumps += instruction->op_class == OP_CLASS_JUMP;
+        sink->op_class_counts[instruction->op_class] += 1;
+    }
+};
+
+void print_counts(CountSink* sink, FILE* stream = stdout) {
+    fprintf(stream, "instructions: %llu\n", (unsigned long long)sink->instructions);
+    fprintf(stream, "bytes:        %llu\n", (unsigned long long)sink->bytes);
+    fprintf(stream, "jumps:        %llu\n", (unsigned long long)sink->jumps);
+
+    fprintf(stream, "\nop classes:\n");
+    for (int i = 0; i < OP_CLASS_COUNT; i++) {
+        fprintf(stream, "  %-38s %llu\n", op_class_names[i], (unsigned long long)sink->op_class_counts[i]);
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+// Per-phase timings and decode counters reported by --stats.
+//
+// Collection only exists when built with ENABLE_STATS (build.bat Stats).
+// Otherwise every STATS_* macro expands to nothing so the decode loop is
+// the same code a production build would get.
+
+#include <time.h>
+
+#include "decoder.h"
+
+#if defined(ENABLE_STATS) && !defined(_MSC_VER)
+    #include <x86intrin.h>
+#endif
+
+enum StatsPhase {
+    STATS_PHASE_READ   = 0,
+    STATS_PHASE_DECODE = 1,
+    STATS_PHASE_LABELS = 2,
+    STATS_PHASE_EMIT   = 3,
+    STATS_PHASE_COUNT  = 4,
+};
+
+const char* stats_phase_names[STATS_PHASE_COUNT] = {
+    "read",
+    "decode",
+    "labels",
+    "emit"
+};
+
+enum StatsFormat {
+    STATS_FORMAT_NONE  = 0,
+    STATS_FORMAT_TEXT  = 1,
+    STATS_FORMAT_JSON  = 2,
+};
+
+#if defined(ENABLE_STATS)
+
+#define STATS_AVAILABLE 1
+
+struct PhaseTiming {
+    u64 wall_ns;
+    u64 cycles;
+
+    u64 start_wall_ns;
+    u64 start_cycles;
+};
+
+struct Stats {
+    PhaseTiming phases[STATS_PHASE_COUNT];
+
+    u64 bytes_decoded;
+    u64 instructions_decoded;
+    u64 op_class_counts[OP_CLASS_COUNT];
+
+    u64 arena_high_water;
+    u64 arena_capacity;
+
+    u64 jump_count;
+    u64 label_count;
+    u64 labels_emitted;
+};
+
+Stats stats;
+
+u64 stats_wall_ns() {
+    timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+void stats_begin_phase(StatsPhase phase) {
+    PhaseTiming* timing = &stats.phases[phase];
+    timing->start_wall_ns = stats_wall_ns();
+    timing->start_cycles  = __rdtsc();
+}
+
+void stats_end_phase(StatsPhase phase) {
+    PhaseTiming* timing = &stats.phases[phase];
+    timing->cycles  += __rdtsc() - timing->start_cycles;
+    timing->wall_ns += stats_wall_ns() - timing->start_wall_ns;
+}
+
+void print_stats(StatsFormat format, FILE* stream = stderr) {
+    if (format == STATS_FORMAT_JSON) {
+        fprintf(stream, "{\n  \"phases\": {\n");
+        for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+            PhaseTiming* timing = &stats.phases[i];
+            fprintf(stream, "    \"%s\": { \"wall_ns\": %llu, \"cycles\": %llu }%s\n",
+                    stats_phase_names[i],
+                    (unsigned long long)timing->wall_ns,
+                    (unsigned long long)timing->cycles,
+                    (i + 1 < STATS_PHASE_COUNT) ? "," : "");
+        }
+        fprintf(stream, "  },\n");
+        fprintf(stream, "  \"bytes_decoded\": %llu,\n", (unsigned long long)stats.bytes_decoded);
+        fprintf(stream, "  \"instructions_decoded\": %llu,\n", (unsigned long long)stats.instructions_decoded);
+        fprintf(stream, "  \"op_classes\": {\n");
+        for (int i = 0; i < OP_CLASS_COUNT; i++) {
+            fprintf(stream, "    \"%s\": %llu%s\n",
+                    op_class_names[i],
+                    (unsigned long long)stats.op_class_counts[i],
+                    (i + 1 < OP_CLASS_COUNT) ? "," : "");
+        }
+        fprintf(stream, "  },\n");
+        fprintf(stream, "  \"arena_high_water\": %llu,\n", (unsigned long long)stats.arena_high_water);
+        fprintf(stream, "  \"arena_capacity\": %llu,\n", (unsigned long long)stats.arena_capacity);
+        fprintf(stream, "  \"jumps\": %llu,\n", (unsigned long long)stats.jump_count);
+        fprintf(stream, "  \"labels\": %llu,\n", (unsigned long long)stats.label_count);
+        fprintf(stream, "  \"labels_emitted\": %llu\n", (unsigned long long)stats.labels_emitted);
+        fprintf(stream, "}\n");
+        return;
+    }
+
+    fprintf(stream, "phase      wall ms        cycles\n");
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        PhaseTiming* timing = &stats.phases[i];
+        fprintf(stream, "%-8s %9.3f %13llu\n",
+                stats_phase_names[i],
+                (double)timing->wall_ns / 1000000.0,
+                (unsigned long long)timing->cycles);
+    }
+
+    fprintf(stream, "\nbytes decoded:        %llu\n", (unsigned long long)stats.bytes_decoded);
+    fprintf(stream, "instructions decoded: %llu\n", (unsigned long long)stats.instructions_decoded);
+
+    fprintf(stream, "\nop classes:\n");
+    for (int i = 0; i < OP_CLASS_COUNT; i++) {
+        fprintf(stream, "  %-38s %llu\n", op_class_names[i], (unsigned long long)stats.op_class_counts[i]);
+    }
+
+    fprintf(stream, "\narena high water:     %llu / %llu bytes\n",
+            (unsigned long long)stats.arena_high_water,
+            (unsigned long long)stats.arena_capacity);
+    fprintf(stream, "jumps:                %llu\n", (unsigned long long)stats.jump_count);
+    fprintf(stream, "labels:               %llu (%llu emitted)\n",
+            (unsigned long long)stats.label_count,
+            (unsigned long long)stats.labels_emitted);
+}
+
+#define STATS_BEGIN_PHASE(phase)       stats_begin_phase(phase)
+#define STATS_END_PHASE(phase)         stats_end_phase(phase)
+#define STATS_COUNT_OP_CLASS(op_class) (stats.op_class_counts[op_class] += 1)
+#define STATS_SET(field, value)        (stats.field = (value))
+#define STATS_ADD(field, value)        (stats.field += (value))
+
+#else
+
+#define STATS_AVAILABLE 0
+
+#define STATS_BEGIN_PHASE(phase)       do {} while (0)
+#define STATS_END_PHASE(phase)         do {} while (0)
+#define STATS_COUNT_OP_CLASS(op_class) do {} while (0)
+#define STATS_SET(field, value)        do { (void)(value); } while (0)
+#define STATS_ADD(field, value)        do {} while (0)
+
+// main() rejects --stats in these builds, so this is never reached.
+void print_stats(StatsFormat, FILE* = stderr) {}
+
+#endif
@@ -1,5 +1,9 @@
+#pragma once
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <cstdint>
 #include <errno.h>
 #include <string.h>
@@ -42,30 +46,45 @@ void log_error_impl(const char *fmt, ...) {
 #define critical_error(...) do { log_error_impl(__VA_ARGS__); ERROR_ABORT(); } while (0)
 #define not_implemented()   critical_error("NOT IMPLEMENTED %s(%d)\n", __FILE__, __LINE__)
 
-struct StringBuilder {
-    char* buffer;
+// A string literal with its length, so copying it never needs strlen.
+struct Text {
+    const char* text;
     u32 length;
 };
 
-void sb_appendf(StringBuilder* builder, const char* fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    builder->length += vsprintf(builder->buffer + builder->length, fmt, ap);
-    va_end(ap);
+#define TEXT(literal) Text{ literal, sizeof(literal) - 1 }
+
+int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
 }
 
-void bubble_sort(int arr[], int n) {
-    for (int i = 0; i < n - 1; i++) {
-        for (int j = 0; j < n - i - 1; j++) {
-            if (arr[j] > arr[j + 1]) {
-                int temp = arr[j];
-                arr[j] = arr[j + 1];
-                arr[j + 1] = temp;
-            }
+void sort_ints(int* values, int count) {
+    qsort(values, count, sizeof(int), compare_ints);
+}
+
+// Drops repeats from a sorted array in place. Returns the new count.
+int unique_ints(int* values, int count) {
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || values[i] != values[unique - 1]) {
+            values[unique++] = values[i];
         }
     }
+    return unique;
 }
 
+#ifdef _MSC_VER
+inline int count_bits(u64 value) { return (int)__popcnt64(value); }
+inline int lowest_bit(u64 value)  { unsigned long index; _BitScanForward64(&index, value); return (int)index; }
+inline int highest_bit(u64 value) { unsigned long index; _BitScanReverse64(&index, value); return (int)index; }
+#else
+inline int count_bits(u64 value) { return __builtin_popcountll(value); }
+inline int lowest_bit(u64 value)  { return __builtin_ctzll(value); }
+inline int highest_bit(u64 value) { return 63 - __builtin_clzll(value); }
+#endif
+
 struct MemoryArena {
     size_t index;
     size_t capacity;
@@ -78,23 +97,51 @@ void init_arena(MemoryArena* arena, size_t size) {
     arena->buffer = (u8*)malloc(size);
 }
 
-void* arena_alloc(MemoryArena* arena, size_t size) {
-    if (arena->index + size >= arena->capacity) {
-        critical_error("arena is out of memory! attempted to allocate %llu.", size);
+// Allocations are aligned for any fundamental type by default; pass a
+// larger power of two for over-aligned types.
+void* arena_alloc(MemoryArena* arena, size_t size, size_t alignment = alignof(max_align_t)) {
+    uintptr_t base = (uintptr_t)arena->buffer;
+    size_t start = ((base + arena->index + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+    
+    if (start + size >= arena->capacity) {
+        critical_error("arena is out of memory! attempted to allocate %llu.", (unsigned long long)size);
         return 0;
     }
     
-    void* mem = &arena->buffer[arena->index];
-    arena->index += size;
+    void* mem = &arena->buffer[start];
+    arena->index = start + size;
     
     return mem;
 }
 
+// Gives back the unused tail of the most recent allocation.
+void arena_trim(MemoryArena* arena, void* allocation, size_t used) {
+    arena->index = (u8*)allocation - arena->buffer + used;
+}
+
 struct MemoryBuffer {
     size_t size;
     u8* buffer;
 };
 
+// Size of an open file in bytes, 64 bit on every platform. Leaves the file
+// at its start.
+u64 file_size(FILE* file) {
+#ifdef _MSC_VER
+    _fseeki64(file, 0, SEEK_END);
+    u64 size = (u64)_ftelli64(file);
+#else
+    fseeko(file, 0, SEEK_END);
+    u64 size = (u64)ftello(file);
+#endif
+    rewind(file);
+    return size;
+}
+
+// Zeroed bytes read_entire_file() leaves after the contents, so code that
+// peeks a few bytes ahead of an instruction stays inside the buffer.
+#define FILE_PADDING 16
+
 bool read_entire_file(MemoryBuffer* fileBuffer, const char* filename, AllocFunc mem_alloc) {
     FILE* file = fopen(filename, "rb");
     if (file == 0) {
@@ -102,13 +149,16 @@ bool read_entire_file(MemoryBuffer* fileBuffer, const char* filename, AllocFunc
         return false;
     }
     
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-	rewind(file);
+    size_t fileSize = (size_t)file_size(file);
     
-    fileBuffer->buffer = (u8*)mem_alloc(fileSize);
-    fread(fileBuffer->buffer, 1, fileSize, file);
-    fileBuffer->size = fileSize;
+    fileBuffer->buffer = (u8*)mem_alloc(fileSize + FILE_PADDING);
+    if (fileBuffer->buffer == 0) {
+        log_error("Failed to allocate %llu bytes for %s", (unsigned long long)fileSize, filename);
+        fclose(file);
+        return false;
+    }
+    fileBuffer->size = fread(fileBuffer->buffer, 1, fileSize, file);
+    memset(fileBuffer->buffer + fileBuffer->size, 0, FILE_PADDING);
 
     fclose(file);
     return true;